@@ -0,0 +1,240 @@
+#include <algorithm> // find, max
+#include <cassert> // assert
+#include <cmath> // sqrt
+#include <cstdio> // printf, fopen, fprintf
+#include <cstdlib> // atoi, atof, strtoull, exit
+#include <map> // map
+#include <string> // string
+#include <sys/resource.h> // getrusage
+#include <time.h> // clock_gettime
+#include <unistd.h> // getopt, optarg, sysconf
+#include "cart/binned_matrix.h" // BinnedMatrix, build
+#include "cart/flat_tree.h" // FlatTree, classify_batch
+#include "cart/matrix.h" // Matrix, load, save_binary, load_binary
+#include "cart/tree_node.h" // TreeNode, train
+#include "cart/util.h" // range, split_string
+#include "random_forest/parallel_forest.h" // Forest, ParallelForest, train, classify_batch
+
+/*
+ * Times loading, training and classification of one CSV for TreeNode, Forest
+ * and ParallelForest at several thread counts, and writes the results as one
+ * flat JSON object. Every measurement is repeated and the best run is kept,
+ * so one slow run does not fail the comparison. With a baseline written by an
+ * earlier run, every result that got worse by more than the tolerance is
+ * reported and the exit status is 1.
+ * */
+
+static double now() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec+t.tv_nsec*1e-9;
+}
+
+static long peak_rss_kb() {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_maxrss;
+}
+
+// Rows classified per second by c, each run over at least a tenth of a second, in the fastest of repeats runs
+static double classify_rate(Classifier &c, Matrix &m, int repeats) {
+  std::vector<int> out(m.rows());
+  double best = 0.0;
+  for (int r = 0; r < repeats; ++r) {
+    long rows = 0;
+    double start = now(), elapsed = 0.0;
+    while (elapsed < 0.1) {
+      c.classify_batch(m, NULL, m.rows(), out.data());
+      rows += m.rows();
+      elapsed = now()-start;
+    }
+    best = std::max(best, rows/elapsed);
+  }
+  return best;
+}
+
+// Seconds of the fastest of repeats trainings of forest on m
+static double train_seconds(Forest &forest, Matrix &m, int repeats) {
+  double best = 0.0;
+  for (int r = 0; r < repeats; ++r) {
+    double start = now();
+    forest.train(m);
+    double seconds = now()-start;
+    if (r == 0 || seconds < best) best = seconds;
+  }
+  return best;
+}
+
+// Percent of the rows of m that c classifies as their last column
+static double accuracy(Classifier &c, Matrix &m) {
+  std::vector<int> out(m.rows());
+  c.classify_batch(m, NULL, m.rows(), out.data());
+  int right = 0;
+  for (int i = 0; i < m.rows(); ++i) right += out[i] == (int)m.at(i, m.columns()-1);
+  return right*100.0/m.rows();
+}
+
+// Reads the flat "name": number objects written by main
+static std::map<std::string, double> read_results(std::string filename) {
+  std::map<std::string, double> results;
+  FILE *file = fopen(filename.c_str(), "r");
+  if (file == NULL) return results;
+  char name[256];
+  double value;
+  while (fscanf(file, " %*[{,] \"%255[^\"]\" : %lf", name, &value) == 2) results[name] = value;
+  fclose(file);
+  return results;
+}
+
+// Rates are better higher, times and sizes lower
+static bool higher_is_better(const std::string &name) {
+  return name.find("per_second") != std::string::npos || name.find("speedup") != std::string::npos ||
+         name.find("accuracy") != std::string::npos;
+}
+
+int main(int argc, char **argv) {
+  std::string data_file, output_file, baseline_file;
+  int n_trees = 10, n_features = 0, max_bins = 0, repeats = 3;
+  uint64_t seed = 1;
+  double tolerance = 0.1;
+  std::vector<int> thread_counts;
+  int c;
+  while ((c = getopt(argc, argv, "t:n:f:b:p:o:c:T:r:R:")) != -1) {
+    switch (c) {
+      case 't': data_file = optarg; break; // CSV to benchmark on, e.g. from generate
+      case 'n': n_trees = atoi(optarg); break; // Trees of the forests
+      case 'f': n_features = atoi(optarg); break; // Features per tree, sqrt of the columns by default
+      case 'b': max_bins = atoi(optarg); break; // Histogram bins, 0 for exact splits
+      case 'p': { // Thread counts of ParallelForest, e.g. 1,2,4
+        std::vector<std::string> counts = split_string(optarg, ",");
+        for (int i = 0; i < counts.size(); ++i) thread_counts.push_back(atoi(counts[i].c_str()));
+        break;
+      }
+      case 'o': output_file = optarg; break; // JSON results, stdout when missing
+      case 'c': baseline_file = optarg; break; // JSON results of an earlier run to compare with
+      case 'T': tolerance = atof(optarg); break; // Allowed relative regression
+      case 'r': repeats = atoi(optarg); // Runs of every measurement, the best one counts
+                assert(repeats > 0); break;
+      case 'R': seed = strtoull(optarg, NULL, 10); break; // Seed of the forests
+      default: exit(1);
+    }
+  }
+  if (data_file.empty()) {
+    fprintf(stderr, "usage: %s -t data.csv [-n trees] [-f features] [-b bins] [-p 1,2,4] [-o out.json] [-c baseline.json] [-T 0.1] [-r 3] [-R 1]\n", argv[0]);
+    return 1;
+  }
+  if (thread_counts.empty())
+    for (int p = 1; p <= sysconf(_SC_NPROCESSORS_ONLN); p *= 2) thread_counts.push_back(p);
+  std::map<std::string, double> results;
+
+  // Loading
+  Matrix m;
+  double best = 0.0;
+  for (int r = 0; r < repeats; ++r) {
+    m = Matrix();
+    double start = now();
+    m.load(data_file);
+    double seconds = now()-start;
+    if (r == 0 || seconds < best) best = seconds;
+  }
+  results["load_csv_seconds"] = best;
+  assert(m.rows() > 0 && m.columns() > 1);
+  std::string buffer = output_file.empty() ? "/tmp/bench.buffer" : output_file+".buffer";
+  m.save_binary(buffer);
+  for (int r = 0; r < repeats; ++r) {
+    Matrix binary;
+    double start = now();
+    binary.load_binary(buffer);
+    double seconds = now()-start;
+    if (r == 0 || seconds < best) best = seconds;
+  }
+  results["load_binary_seconds"] = best;
+  remove(buffer.c_str());
+  results["rows"] = m.rows();
+  results["columns"] = m.columns();
+  results["peak_rss_kb_after_load"] = peak_rss_kb();
+  if (n_features <= 0) n_features = std::max(1, (int)sqrt(m.columns()-1.0));
+  n_features = std::min(n_features, m.columns()-1);
+
+  // One tree on all features
+  TreeNode tree;
+  for (int r = 0; r < repeats; ++r) {
+    double start = now();
+    BinnedMatrix bins;
+    if (max_bins > 0) bins.build(m, max_bins);
+    tree.train(m, range(m.columns()-1), (max_bins > 0) ? &bins : NULL);
+    double seconds = now()-start;
+    if (r == 0 || seconds < best) best = seconds;
+  }
+  results["tree_train_seconds"] = best;
+  FlatTree flat(tree);
+  results["tree_classify_rows_per_second"] = classify_rate(flat, m, repeats);
+  results["tree_train_accuracy"] = accuracy(flat, m);
+
+  // Serial forest
+  Forest forest(n_trees, n_features);
+  forest.set_seed(seed);
+  forest.set_max_bins(max_bins);
+  results["forest_train_seconds"] = train_seconds(forest, m, repeats);
+  results["forest_classify_rows_per_second"] = classify_rate(forest, m, repeats);
+  results["forest_train_accuracy"] = accuracy(forest, m);
+
+  // Thread scaling, against one thread timed like the others whether it was asked for or not
+  double one_thread = 0.0;
+  if (std::find(thread_counts.begin(), thread_counts.end(), 1) == thread_counts.end()) {
+    ParallelForest parallel(n_trees, n_features, 1);
+    parallel.set_seed(seed);
+    parallel.set_max_bins(max_bins);
+    one_thread = train_seconds(parallel, m, repeats);
+  }
+  for (int i = 0; i < thread_counts.size(); ++i) {
+    int p = thread_counts[i];
+    ParallelForest parallel(n_trees, n_features, p);
+    parallel.set_seed(seed); // The same trees at every thread count
+    parallel.set_max_bins(max_bins);
+    double seconds = train_seconds(parallel, m, repeats);
+    char name[64];
+    snprintf(name, sizeof(name), "parallel_forest_p%d_train_seconds", p);
+    results[name] = seconds;
+    if (p == 1) one_thread = seconds;
+    snprintf(name, sizeof(name), "parallel_forest_p%d_classify_rows_per_second", p);
+    results[name] = classify_rate(parallel, m, repeats);
+  }
+  for (int i = 0; i < thread_counts.size(); ++i) {
+    char name[64];
+    snprintf(name, sizeof(name), "parallel_forest_p%d_train_seconds", thread_counts[i]);
+    double seconds = results[name];
+    snprintf(name, sizeof(name), "parallel_forest_p%d_speedup", thread_counts[i]);
+    results[name] = one_thread/seconds;
+  }
+  results["peak_rss_kb"] = peak_rss_kb();
+
+  FILE *file = output_file.empty() ? stdout : fopen(output_file.c_str(), "w");
+  if (file == NULL) {
+    fprintf(stderr, "Cannot write %s\n", output_file.c_str());
+    return 1;
+  }
+  std::map<std::string, double>::iterator it;
+  for (it = results.begin(); it != results.end(); ++it)
+    fprintf(file, "%s\"%s\": %.6g", it == results.begin() ? "{\n  " : ",\n  ", it->first.c_str(), it->second);
+  fprintf(file, "\n}\n");
+  if (file != stdout) fclose(file);
+
+  if (baseline_file.empty()) return 0;
+  std::map<std::string, double> baseline = read_results(baseline_file);
+  if (baseline.empty()) {
+    fprintf(stderr, "Cannot read baseline %s\n", baseline_file.c_str());
+    return 1;
+  }
+  int regressions = 0;
+  for (it = baseline.begin(); it != baseline.end(); ++it) {
+    const std::string &name = it->first;
+    if (results.count(name) == 0 || it->second <= 0.0 || name == "rows" || name == "columns") continue;
+    double ratio = results[name]/it->second;
+    bool worse = higher_is_better(name) ? ratio < 1.0-tolerance : ratio > 1.0+tolerance;
+    fprintf(stderr, "%-40s %12.6g %12.6g %+7.1f%%%s\n", name.c_str(), it->second, results[name], (ratio-1.0)*100.0,
+            worse ? "  REGRESSION" : "");
+    if (worse) ++regressions;
+  }
+  return regressions > 0 ? 1 : 0;
+}
@@ -0,0 +1,72 @@
+#include <algorithm> // min
+#include <cassert> // assert
+#include <cstdio> // fopen, fprintf, setvbuf
+#include <cstdlib> // atoi, atol, atof, srand, rand, exit
+#include <string> // string
+#include <unistd.h> // getopt, optarg
+#include <vector>
+
+/*
+ * Writes a CSV in the format of data/: an id column, the features and the
+ * class. The class of a row is the best of n_classes random linear scores
+ * over the first few features, so trees can learn it, and a noise fraction
+ * of the rows gets a random class instead.
+ * */
+static double uniform() { return rand()/(RAND_MAX+1.0); }
+
+int main(int argc, char **argv) {
+  long n_rows = 100000;
+  int n_features = 10, n_classes = 2, seed = 1;
+  double noise = 0.05;
+  std::string output;
+  int c;
+  while ((c = getopt(argc, argv, "r:f:c:n:s:o:")) != -1) {
+    switch (c) {
+      case 'r': n_rows = atol(optarg); break; // Rows
+      case 'f': n_features = atoi(optarg); break; // Feature columns
+      case 'c': n_classes = atoi(optarg); break; // Classes 0..n_classes-1
+      case 'n': noise = atof(optarg); break; // Fraction of rows with a random class
+      case 's': seed = atoi(optarg); break; // Same seed, same file
+      case 'o': output = optarg; break; // Output CSV, stdout when missing
+      default: exit(1);
+    }
+  }
+  assert(n_rows > 0 && n_features > 0 && n_classes > 0 && n_classes <= 256);
+  assert(noise >= 0.0 && noise <= 1.0);
+  srand(seed);
+  FILE *file = output.empty() ? stdout : fopen(output.c_str(), "w");
+  if (file == NULL) {
+    fprintf(stderr, "Cannot write %s\n", output.c_str());
+    return 1;
+  }
+  static char buffer[1 << 20];
+  setvbuf(file, buffer, _IOFBF, sizeof(buffer));
+
+  int informative = std::min(n_features, 5);
+  std::vector<double> weights(n_classes*informative);
+  for (int i = 0; i < weights.size(); ++i) weights[i] = uniform()*2.0-1.0;
+
+  fprintf(file, "id");
+  for (int j = 0; j < n_features; ++j) fprintf(file, ",f%d", j);
+  fprintf(file, ",class\n");
+  std::vector<double> row(n_features);
+  for (long i = 0; i < n_rows; ++i) {
+    for (int j = 0; j < n_features; ++j) row[j] = uniform();
+    int label = 0;
+    double best = -1e300;
+    for (int k = 0; k < n_classes; ++k) {
+      double score = 0.0;
+      for (int j = 0; j < informative; ++j) score += weights[k*informative+j]*row[j];
+      if (score > best) {
+        best = score;
+        label = k;
+      }
+    }
+    if (uniform() < noise) label = rand()%n_classes;
+    fprintf(file, "%ld", i);
+    for (int j = 0; j < n_features; ++j) fprintf(file, ",%.6f", row[j]);
+    fprintf(file, ",%d\n", label);
+  }
+  if (file != stdout) fclose(file);
+  return 0;
+}
@@ -0,0 +1,85 @@
+#include <algorithm> // sort, upper_bound, min, max
+#include <cassert> // assert
+#include "cart/binned_matrix.h"
+#include "cart/task_spawner.h" // TaskSpawner, run_chunks
+
+BinnedMatrix::BinnedMatrix() : n_rows(0), n_columns(0), n_bins(0) {}
+
+// At most max_bins-1 boundaries at the quantiles of x[rows]
+static std::vector<double> quantile_cuts(const VectorView &x, const std::vector<int> &rows, int max_bins) { // O(rows*log(rows))
+  std::vector<double> values(rows.size());
+  for (int i = 0; i < rows.size(); ++i) values[i] = x[rows[i]];
+  std::sort(values.begin(), values.end());
+  std::vector<double> cuts;
+  for (int b = 1; b < max_bins; ++b) {
+    double cut = values[(long)values.size()*b/max_bins];
+    if (cut > values[0] && (cuts.empty() || cut > cuts.back())) cuts.push_back(cut);
+  }
+  return cuts;
+}
+
+/*
+ * A range of a BinnedMatrix that one thread builds: first the cuts of the
+ * columns [begin, end), then, once all cuts are known, the codes of the rows
+ * [begin, end), so that no two threads write to the same cache line.
+ * */
+struct BinChunk {
+  Matrix *matrix;
+  const std::vector<int> *rows; // Rows the cuts are taken from
+  int max_bins;
+  int begin;
+  int end;
+  int n_columns;
+  std::vector<std::vector<double> > *boundaries;
+  unsigned char *codes;
+};
+
+static void *cut_chunk(void *arg) { // O(rows*log(rows)) per column
+  BinChunk *chunk = (BinChunk*)arg;
+  for (int col = chunk->begin; col < chunk->end; ++col)
+    (*chunk->boundaries)[col] = quantile_cuts(chunk->matrix->column(col), *chunk->rows, chunk->max_bins);
+  return NULL;
+}
+
+static void *code_chunk(void *arg) { // O(rows*columns*log(bins))
+  BinChunk *chunk = (BinChunk*)arg;
+  Matrix &m = *chunk->matrix;
+  for (int col = 0; col < chunk->n_columns; ++col) {
+    VectorView x = m.column(col);
+    const std::vector<double> &cuts = (*chunk->boundaries)[col];
+    unsigned char *code = chunk->codes+(long)chunk->begin*chunk->n_columns+col;
+    for (int row = chunk->begin; row < chunk->end; ++row, code += chunk->n_columns)
+      *code = std::upper_bound(cuts.begin(), cuts.end(), x[row])-cuts.begin();
+  }
+  return NULL;
+}
+
+void BinnedMatrix::build(const MatrixView &view, int max_bins, TaskSpawner *spawner) { // O(rows*columns*log(rows)/threads)
+  assert(max_bins > 1 && max_bins <= MAX_BINS && view.rows() > 0);
+  Matrix &m = view.matrix();
+  n_rows = m.rows();
+  n_columns = std::max(0, m.columns()-1);
+  n_bins = max_bins;
+  boundaries.assign(n_columns, std::vector<double>());
+  codes.assign((long)n_rows*n_columns, 0);
+  long n_threads = (spawner != NULL) ? spawner->threads() : 1;
+  std::vector<BinChunk> chunks(std::max(1L, std::min(n_threads, (long)n_columns)));
+  for (int i = 0; i < chunks.size(); ++i) {
+    BinChunk &chunk = chunks[i];
+    chunk.matrix = &m;
+    chunk.rows = &view.row_indices();
+    chunk.max_bins = max_bins;
+    chunk.begin = (long)n_columns*i/chunks.size();
+    chunk.end = (long)n_columns*(i+1)/chunks.size();
+    chunk.n_columns = n_columns;
+    chunk.boundaries = &boundaries;
+    chunk.codes = codes.data();
+  }
+  run_chunks(chunks, cut_chunk, spawner);
+  chunks.resize(std::max(1L, std::min(n_threads, (long)n_rows/4096+1)), chunks[0]);
+  for (int i = 0; i < chunks.size(); ++i) {
+    chunks[i].begin = (long)n_rows*i/chunks.size();
+    chunks[i].end = (long)n_rows*(i+1)/chunks.size();
+  }
+  run_chunks(chunks, code_chunk, spawner);
+}
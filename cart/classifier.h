@@ -6,6 +6,10 @@
 class Classifier {
  public:
   virtual void train(Matrix &m) { printf("classifier no training"); };
-  virtual int classify(std::vector<double> &row) { return 0; };
+  virtual int classify(const VectorView &row) { return 0; };
+  // Classify rows[0..n) of m into out[0..n), or the first n rows when rows is NULL
+  virtual void classify_batch(Matrix &m, const int *rows, int n, int *out) {
+    for (int i = 0; i < n; ++i) out[i] = classify(m[rows != NULL ? rows[i] : i]);
+  };
 };
 #endif
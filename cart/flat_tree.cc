@@ -0,0 +1,133 @@
+#include <algorithm> // min, max
+#include <cassert>
+#include <queue> // queue
+#include "cart/flat_tree.h"
+
+static const int TRAVERSAL_BLOCK = 16; // Rows walked down a tree together
+
+FlatTree::FlatTree() : mapped(NULL), n_mapped(0) {}
+FlatTree::FlatTree(TreeNode &root) : mapped(NULL), n_mapped(0) { compile(root); }
+
+void FlatTree::compile(TreeNode &root) { // O(nodes)
+  mapped = NULL;
+  n_mapped = 0;
+  nodes.clear();
+  std::queue<TreeNode*> pending; // Nodes in breadth-first order, pending[i] becomes nodes[i]
+  pending.push(&root);
+  while (!pending.empty()) {
+    TreeNode *node = pending.front();
+    pending.pop();
+    FlatNode flat;
+    flat.value = node->value;
+    if (node->left == NULL) { // Leaf
+      flat.value = node->classification;
+      flat.column = -1;
+      flat.child = node->class_id;
+    } else {
+      flat.column = node->column;
+      flat.child = nodes.size()+pending.size()+1; // Children are queued right after the nodes already waiting
+      pending.push(node->left);
+      pending.push(node->right);
+    }
+    nodes.push_back(flat);
+  }
+}
+
+void FlatTree::map(const FlatNode *nodes, int n) { // O(1)
+  this->nodes.clear();
+  mapped = nodes;
+  n_mapped = n;
+}
+
+void FlatTree::expand(TreeNode &root) { // O(nodes)
+  assert(count() > 0);
+  root.clear();
+  root.arena = new NodeArena;
+  NodeCursor cursor(root.arena);
+  expand(0, root, cursor);
+}
+
+void FlatTree::expand(int index, TreeNode &node, NodeCursor &cursor) { // O(subtree)
+  const FlatNode &flat = root()[index];
+  if (flat.column < 0) {
+    node.column = -1;
+    node.classification = flat.value;
+    node.class_id = flat.child;
+    return;
+  }
+  node.column = flat.column;
+  node.value = flat.value;
+  node.classification = node.class_id = -1;
+  node.left = cursor.pair();
+  node.right = node.left+1;
+  expand(flat.child, *node.left, cursor);
+  expand(flat.child+1, *node.right, cursor);
+}
+
+int FlatTree::count() { return (mapped != NULL) ? n_mapped : nodes.size(); }
+
+int FlatTree::columns() { // O(nodes)
+  const FlatNode *base = root();
+  int n = count(), result = 0;
+  for (int i = 0; i < n; ++i) result = std::max(result, base[i].column+1);
+  return result;
+}
+
+// The leaf reached by row
+static const FlatNode *leaf(const FlatNode *base, const VectorView &row) { // O(depth)
+  const FlatNode *node = base;
+  while (node->column >= 0) node = base + node->child + (row[node->column] >= node->value);
+  return node;
+}
+
+/*
+ * Walk blocks of rows down the tree together, one level per round. The loads
+ * of different rows are independent, so their cache misses overlap instead of
+ * being paid one row after another.
+ * */
+void FlatTree::leaves(Matrix &m, const int *rows, int n, const FlatNode **out) { // O(n*depth)
+  assert(count() > 0);
+  const FlatNode *base = root();
+  for (int start = 0; start < n; start += TRAVERSAL_BLOCK) {
+    int count = std::min(TRAVERSAL_BLOCK, n-start);
+    const FlatNode *node[TRAVERSAL_BLOCK];
+    int row[TRAVERSAL_BLOCK];
+    for (int j = 0; j < count; ++j) {
+      node[j] = base;
+      row[j] = (rows != NULL) ? rows[start+j] : start+j;
+    }
+    bool active = true;
+    while (active) {
+      active = false;
+      for (int j = 0; j < count; ++j) {
+        const FlatNode *p = node[j];
+        if (p->column < 0) continue;
+        node[j] = base + p->child + (m.at(row[j], p->column) >= p->value);
+        active = true;
+      }
+    }
+    for (int j = 0; j < count; ++j) out[start+j] = node[j];
+  }
+}
+
+int FlatTree::classify(const VectorView &row) {
+  assert(count() > 0);
+  return leaf(root(), row)->value;
+}
+
+int FlatTree::classify_id(const VectorView &row) {
+  assert(count() > 0);
+  return leaf(root(), row)->child;
+}
+
+void FlatTree::classify_batch(Matrix &m, const int *rows, int n, int *out) { // O(n*depth)
+  std::vector<const FlatNode*> reached(n);
+  leaves(m, rows, n, reached.data());
+  for (int i = 0; i < n; ++i) out[i] = reached[i]->value;
+}
+
+void FlatTree::classify_batch_ids(Matrix &m, const int *rows, int n, int *out) { // O(n*depth)
+  std::vector<const FlatNode*> reached(n);
+  leaves(m, rows, n, reached.data());
+  for (int i = 0; i < n; ++i) out[i] = reached[i]->child;
+}
@@ -0,0 +1,43 @@
+#ifndef CART_FLAT_TREE_H_
+#define CART_FLAT_TREE_H_
+#include <vector>
+#include "cart/tree_node.h" // Classifier, TreeNode
+
+// A node of a FlatTree packed into 16 bytes, four nodes per cache line
+struct FlatNode {
+  double value; // Rows with row[column] < value go to nodes[child], the others to nodes[child+1], or the classification of a leaf
+  int column; // -1 for a leaf
+  int child; // Offset of the left child, or the class id of a leaf
+};
+
+/*
+ * Pointer-free copy of a trained TreeNode for classification. The nodes are
+ * stored breadth-first in one array, so the top levels that every row visits
+ * share a few cache lines and both children of a node are adjacent.
+ * */
+class FlatTree : public Classifier {
+ private:
+  std::vector<FlatNode> nodes;
+  const FlatNode *mapped; // Nodes used in place from a ModelFile instead of nodes, or NULL
+  int n_mapped;
+  const FlatNode *root() { return (mapped != NULL) ? mapped : nodes.data(); }
+  void expand(int index, TreeNode &node, NodeCursor &cursor);
+  void leaves(Matrix &m, const int *rows, int n, const FlatNode **out);
+ public:
+  FlatTree();
+  FlatTree(TreeNode &root);
+  void compile(TreeNode &root);
+  // Use n nodes owned by someone else, e.g. a mapped model file, which must outlive this tree
+  void map(const FlatNode *nodes, int n);
+  // Rebuild the pointer tree, e.g. to train on from a loaded model
+  void expand(TreeNode &root);
+  const FlatNode *data() { return root(); }
+  int count();
+  // Columns a row needs to be classified: the largest split column plus one
+  int columns();
+  virtual int classify(const VectorView &row);
+  int classify_id(const VectorView &row);
+  virtual void classify_batch(Matrix &m, const int *rows, int n, int *out);
+  void classify_batch_ids(Matrix &m, const int *rows, int n, int *out);
+};
+#endif
@@ -1,5 +1,9 @@
 #include <cstdio>
+#include <cstdlib> // atoi
+#include "cart/binned_matrix.h" // BinnedMatrix, build
+#include "cart/flat_tree.h" // FlatTree, classify
 #include "cart/matrix.h" // Matrix, load, rows, columns, operator
+#include "cart/matrix_view.h" // MatrixView
 #include "cart/tree_node.h" // TreeNode, train, count, classify
 #include "cart/util.h" // range
 
@@ -8,23 +12,28 @@ int main(int argc, char *argv[]) {
   std::string filename(argv[1]);
   std::string output_filename(argv[2]);
   Matrix m;
-  m.load(filename);
+  m.cache_load(filename);
   printf("\n\n%d rows and %d columns\n", m.rows(), m.columns());
 
   // Model build
   TreeNode tree;
   std::vector<int> columns = range(2); // the columns of features
-  tree.train(m, columns);
+  int max_bins = (argc > 3) ? atoi(argv[3]) : 0; // Histogram bins per feature, 0 for exact splits
+  BinnedMatrix bins;
+  if (max_bins > 0) bins.build(m, max_bins);
+  tree.train(m, columns, (max_bins > 0) ? &bins : NULL);
   printf("%d nodes in tree\n", tree.count());
+  FlatTree flat(tree);
 
   // Output:Model validation
   // Analyze the results of the tree against training dataset
   int right = 0;
   int wrong = 0;
+  std::vector<int> predictions(m.rows());
+  flat.classify_batch(m, NULL, m.rows(), predictions.data());
   for (int i = 0; i < m.rows(); ++i) {
-    std::vector<double> &row = m[i];
-    int actual_class = tree.classify(row);
-    int expected_class = row[row.size()-1];
+    int actual_class = predictions[i];
+    int expected_class = m.at(i, m.columns()-1);
     if (actual_class == expected_class) ++right;
     else ++wrong;
   }
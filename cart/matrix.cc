@@ -1,85 +1,492 @@
+#include <algorithm> // min, max, count
 #include <cassert> // assert
-#include <fstream> // ifstream
+#include <cstdio> // fprintf, fopen, fwrite, rename
+#include <cstdlib> // strtod
+#include <cstring> // memchr, memcpy, memmove, memrchr
+#include <fcntl.h> // open
 #include <string> // string
+#include <sys/mman.h> // mmap, munmap, madvise
+#include <sys/stat.h> // fstat
+#include <unistd.h> // close, read, sysconf
 #include "cart/matrix.h"
-#include "cart/util.h" // split_string, range, join
+#include "cart/task_spawner.h" // run_chunks
+#include "cart/util.h" // split_string, range
+#include "cart/writer.h" // BufferedWriter
 
-Matrix::Matrix() {}
+Matrix::Matrix(Layout layout) {
+  n_rows = n_columns = 0;
+  this->layout = layout;
+}
+
+static const double POWERS_OF_TEN[] = {
+  1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+  1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+/*
+ * Allocation-free conversion of one field to double. Plain decimals whose
+ * digits fit in 53 bits and whose exponent is within 10^22 are exact with a
+ * single multiplication or division, everything else goes through strtod on
+ * a copy of the whole field, which keeps the prefix semantics of stod.
+ * */
+static double parse_double(const char *p, const char *end) { // O(end-p)
+  const char *start = p;
+  bool negative = false;
+  if (p < end && (*p == '-' || *p == '+')) negative = (*p++ == '-');
+  unsigned long long mantissa = 0;
+  int exponent = 0, digits = 0;
+  bool exact = true;
+  for (; p < end && *p >= '0' && *p <= '9'; ++p, ++digits) {
+    if (mantissa > (1ULL<<53)) exact = false; // Stop before the product overflows, strtod takes over
+    else mantissa = mantissa*10+(*p-'0');
+  }
+  if (p < end && *p == '.') {
+    for (++p; p < end && *p >= '0' && *p <= '9'; ++p, ++digits) {
+      if (mantissa > (1ULL<<53)) exact = false;
+      else mantissa = mantissa*10+(*p-'0');
+      --exponent;
+    }
+  }
+  if (p < end && (*p == 'e' || *p == 'E')) {
+    ++p;
+    bool negative_exponent = false;
+    if (p < end && (*p == '-' || *p == '+')) negative_exponent = (*p++ == '-');
+    int e = 0;
+    for (; p < end && *p >= '0' && *p <= '9'; ++p) e = (e < 10000) ? e*10+(*p-'0') : e;
+    exponent += negative_exponent ? -e : e;
+  }
+  // Only a mantissa the double holds exactly is rounded once, by the power of ten
+  exact = exact && mantissa <= (1ULL<<53);
+  if (exact && digits > 0 && p == end && exponent >= -22 && exponent <= 22) {
+    double value = (double)mantissa;
+    value = (exponent < 0) ? value/POWERS_OF_TEN[-exponent] : value*POWERS_OF_TEN[exponent];
+    return negative ? -value : value;
+  }
+  // The field is not terminated, strtod must stop at its end
+  char buffer[64];
+  if (end-start < (long)sizeof(buffer)) {
+    memcpy(buffer, start, end-start);
+    buffer[end-start] = '\0';
+    return strtod(buffer, NULL);
+  }
+  return strtod(std::string(start, end).c_str(), NULL);
+}
+
+// Find the next non-empty field of a line, like split_string(line, ",")
+static bool next_field(const char *&p, const char *end, const char *&field, const char *&field_end) { // O(field)
+  while (p < end && *p == ',') ++p;
+  if (p >= end) return false;
+  field = p;
+  while (p < end && *p != ',') ++p;
+  field_end = p;
+  return true;
+}
+
+// End of the line starting at p, and the start of the next one in next
+static const char *line_end(const char *p, const char *end, const char *&next) { // O(line)
+  const char *newline = (const char*)memchr(p, '\n', end-p);
+  if (newline == NULL) newline = end;
+  next = (newline < end) ? newline+1 : end;
+  if (newline > p && newline[-1] == '\r') --newline;
+  return newline;
+}
 
-void Matrix::load(std::string filename, bool use_column_labels, bool use_row_lables) { // O(elements.size()*elements[0].size())
-  std::ifstream file(filename);
-  std::string line;
-  int line_number = 0;
-  while (getline(file, line)) {
-    std::vector<std::string> tokens = split_string(line, ",");
-    if (tokens.size() == 0) {
+static int count_fields(const char *p, const char *end) { // O(line)
+  int fields = 0;
+  const char *field, *field_end;
+  while (next_field(p, end, field, field_end)) ++fields;
+  return fields;
+}
+
+/*
+ * A newline-aligned piece of the mapped file. The first pass counts its lines
+ * and well-formed rows, the second parses the rows straight into the storage
+ * of the Matrix starting at first_row.
+ * */
+struct LoadChunk {
+  const char *begin;
+  const char *end;
+  int fields; // Fields of a well-formed row, including the row label
+  int lines;
+  int rows;
+  int first_line;
+  int first_row;
+  double *elements;
+  long row_stride;
+  long column_stride;
+  std::string *row_labels;
+};
+
+static void *count_chunk(void *arg) { // O(chunk size)
+  LoadChunk *chunk = (LoadChunk*)arg;
+  chunk->lines = chunk->rows = 0;
+  const char *next;
+  for (const char *p = chunk->begin; p < chunk->end; p = next) {
+    const char *end = line_end(p, chunk->end, next);
+    if (count_fields(p, end) == chunk->fields) ++chunk->rows;
+    ++chunk->lines;
+  }
+  return NULL;
+}
+
+static void *parse_chunk(void *arg) { // O(chunk size)
+  LoadChunk *chunk = (LoadChunk*)arg;
+  int row = chunk->first_row;
+  int line_number = chunk->first_line;
+  const char *next;
+  for (const char *p = chunk->begin; p < chunk->end; p = next, ++line_number) {
+    const char *end = line_end(p, chunk->end, next);
+    int fields = count_fields(p, end);
+    if (fields == 0) {
       //printf("Matrix.load(): skipping blank line on line #%d\n", line_number);
-      ++line_number;
       continue;
     }
-    if (use_column_labels && line_number==0) { // Removes the first row of field names
-      column_labels = tokens; // Fill in the first line of the field name to column_labels
-      ++line_number;
+    int label_fields = (chunk->row_labels != NULL) ? 1 : 0;
+    if (fields != chunk->fields) { // Contiguous storage cannot hold ragged rows
+      fprintf(stderr, "Matrix.load(): skipping row with %d columns on line #%d\n", fields-label_fields, line_number);
       continue;
-    } else {
-      if (use_row_lables) {
-        row_labels.push_back(tokens[0]); // 填充第一列id至行标签 row_labels
-        tokens.erase(tokens.begin() + 0);
-      }
-      std::vector<double> row;
-      for (int i = 0; i < tokens.size(); ++i) { // 填充某一行除了第一个标签至row
-        double element = stod(tokens[i]);
-        row.push_back(element);
-      }
-      elements.push_back(row); // 填充除了第一行,第一列标签至elements
-      ++line_number;
     }
+    const char *field, *field_end;
+    if (chunk->row_labels != NULL) {
+      next_field(p, end, field, field_end);
+      chunk->row_labels[row].assign(field, field_end); // 填充第一列id至行标签 row_labels
+    }
+    double *element = chunk->elements + row*chunk->row_stride;
+    while (next_field(p, end, field, field_end)) { // 填充某一行除了第一个标签至elements
+      *element = parse_double(field, field_end);
+      element += chunk->column_stride;
+    }
+    ++row;
+  }
+  return NULL;
+}
+
+/*
+ * Parse the lines in [body, end) as rows of the given number of fields in
+ * parallel: one pass counts the rows of every chunk so that the storage is
+ * allocated once, a second pass writes every value into place. Returns the
+ * number of lines, first_line numbers the first one in messages.
+ * */
+int Matrix::parse_rows(const char *body, const char *end, int fields, int first_line, bool use_row_lables) { // O(rows*columns/threads)
+  int label_fields = use_row_lables ? 1 : 0;
+  long n_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  long n_chunks = std::max(1L, std::min(n_threads, (long)(end-body)/(1L<<20)+1));
+  std::vector<LoadChunk> chunks(n_chunks);
+  const char *p = body;
+  for (int i = 0; i < n_chunks; ++i) {
+    chunks[i].begin = p;
+    p = (i == n_chunks-1) ? end : std::max(p, body+(end-body)*(i+1)/n_chunks);
+    if (p < end) line_end(p, end, p); // Move to the start of the next line
+    chunks[i].end = p;
+    chunks[i].fields = fields;
+  }
+  run_chunks(chunks, count_chunk);
+
+  n_columns = fields-label_fields;
+  n_rows = 0;
+  for (int i = 0; i < n_chunks; ++i) {
+    chunks[i].first_row = n_rows;
+    chunks[i].first_line = first_line;
+    n_rows += chunks[i].rows;
+    first_line += chunks[i].lines;
+  }
+  elements.assign((long)n_rows*n_columns, 0.0);
+  row_labels.resize(use_row_lables ? n_rows : 0);
+  for (int i = 0; i < n_chunks; ++i) {
+    chunks[i].elements = elements.data();
+    chunks[i].row_stride = (layout == COLUMN_MAJOR) ? 1 : n_columns;
+    chunks[i].column_stride = (layout == COLUMN_MAJOR) ? n_rows : 1;
+    chunks[i].row_labels = use_row_lables ? row_labels.data() : NULL;
+  }
+  run_chunks(chunks, parse_chunk);
+  int lines = 0;
+  for (int i = 0; i < n_chunks; ++i) lines += chunks[i].lines;
+  return lines;
+}
+
+const char *map_file(std::string filename, size_t min_size, size_t &size) { // O(1)
+  int fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0) return NULL;
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < min_size) {
+    close(fd);
+    return NULL;
+  }
+  size = st.st_size;
+  const char *data = (const char*)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  return (data == MAP_FAILED) ? NULL : data;
+}
+
+/*
+ * Read the column labels from the first line of a CSV in [data, end) when
+ * asked to and it is not blank, and count the fields of the first non-blank
+ * line after it, which decides the number of columns. Returns where the rows
+ * start, first_line is the number of that line.
+ * */
+static const char *read_text_header(const char *data, const char *end, bool use_column_labels,
+                                    std::vector<std::string> &column_labels, int &first_line, int &fields) { // O(first lines)
+  const char *body = data;
+  first_line = 0;
+  const char *next;
+  const char *header_end = line_end(data, end, next);
+  if (use_column_labels && count_fields(data, header_end) > 0) { // Removes the first row of field names
+    column_labels = split_string(std::string(data, header_end), ","); // Fill in the first line of the field name to column_labels
+    body = next;
+    first_line = 1;
+  }
+  fields = 0;
+  for (const char *p = body; p < end && fields == 0; p = next) fields = count_fields(p, line_end(p, end, next));
+  return body;
+}
+
+// The file is mapped into memory and its body parsed by parse_rows
+void Matrix::load(std::string filename, bool use_column_labels, bool use_row_lables) { // O(rows*columns/threads)
+  size_t size;
+  const char *data = map_file(filename, 1, size);
+  if (data == NULL) return;
+  const char *end = data+size;
+  int first_line, fields;
+  const char *body = read_text_header(data, end, use_column_labels, column_labels, first_line, fields);
+  int label_fields = use_row_lables ? 1 : 0;
+  if (fields <= label_fields) {
+    munmap((void*)data, size);
+    return;
+  }
+
+  parse_rows(body, end, fields, first_line, use_row_lables);
+  munmap((void*)data, size);
+  encode_classes();
+}
+
+static const int BINARY_MAGIC = 0x4d545242; // "BRTM"
+static const int BINARY_VERSION = 1;
+
+/*
+ * Header of the binary format, followed by the column labels, the row labels
+ * and, at the next multiple of 8 bytes, the n_rows*n_columns elements in the
+ * stored layout. Labels are a uint64 count and then a uint64 length and the
+ * bytes of every label.
+ * */
+struct BinaryHeader {
+  int magic;
+  int version;
+  int flags; // 1: column labels were read from the CSV, 2: row labels were
+  int layout;
+  int n_rows;
+  int n_columns;
+};
+
+static void write_labels(FILE *file, const std::vector<std::string> &labels) {
+  unsigned long long count = labels.size();
+  fwrite(&count, sizeof(count), 1, file);
+  for (int i = 0; i < labels.size(); ++i) {
+    unsigned long long length = labels[i].size();
+    fwrite(&length, sizeof(length), 1, file);
+    fwrite(labels[i].data(), 1, length, file);
   }
-  file.close();
 }
 
-int Matrix::rows() { return elements.size(); }// O(1)
+static bool read_labels(const char *&p, const char *end, std::vector<std::string> &labels) {
+  unsigned long long count;
+  if (end-p < sizeof(count)) return false;
+  memcpy(&count, p, sizeof(count));
+  p += sizeof(count);
+  labels.resize(count);
+  for (unsigned long long i = 0; i < count; ++i) {
+    unsigned long long length;
+    if (end-p < sizeof(length)) return false;
+    memcpy(&length, p, sizeof(length));
+    p += sizeof(length);
+    if (end-p < length) return false;
+    labels[i].assign(p, length);
+    p += length;
+  }
+  return true;
+}
+
+/*
+ * Check the header of a mapped save_binary file of at least
+ * sizeof(BinaryHeader) bytes against the labels asked for, and read its column
+ * labels. p is left on the row labels.
+ * */
+static bool read_binary_header(const char *data, const char *end, bool use_column_labels, bool use_row_lables,
+                               BinaryHeader &header, std::vector<std::string> &column_labels, const char *&p) { // O(column labels)
+  memcpy(&header, data, sizeof(header));
+  int flags = (use_column_labels ? 1 : 0) | (use_row_lables ? 2 : 0);
+  p = data+sizeof(header);
+  return header.magic == BINARY_MAGIC && header.version == BINARY_VERSION && header.flags == flags &&
+         header.n_rows >= 0 && header.n_columns >= 0 && read_labels(p, end, column_labels);
+}
 
-int Matrix::columns() { // O(1)
-  if (elements.size() == 0) return 0;
-  else return elements[0].size();
+// Map a file written by save_binary, returns false if it is missing or was written differently
+bool Matrix::load_binary(std::string filename, bool use_column_labels, bool use_row_lables) { // O(rows*columns) copy, no parsing
+  size_t size;
+  const char *data = map_file(filename, sizeof(BinaryHeader), size);
+  if (data == NULL) return false;
+  const char *end = data+size;
+
+  BinaryHeader header;
+  const char *p;
+  std::vector<std::string> columns, rows;
+  bool ok = read_binary_header(data, end, use_column_labels, use_row_lables, header, columns, p) &&
+            read_labels(p, end, rows);
+  long count = (long)header.n_rows*header.n_columns;
+  p = data+(p-data+7)/8*8;
+  ok = ok && p <= end && (end-p) == count*sizeof(double);
+  if (ok) {
+    Layout target = layout;
+    column_labels.swap(columns);
+    row_labels.swap(rows);
+    n_rows = header.n_rows;
+    n_columns = header.n_columns;
+    layout = (Layout)header.layout;
+    elements.resize(count);
+    if (count > 0) memcpy(elements.data(), p, count*sizeof(double));
+    set_layout(target);
+    encode_classes();
+  }
+  munmap((void*)data, size);
+  return ok;
 }
 
-std::vector<double> &Matrix::operator[](int i) { // std::vector<double> $row = m[i] in main.cc
-  assert(i < elements.size());
-  return elements[i];
+void Matrix::save_binary(std::string filename, bool use_column_labels, bool use_row_lables) {
+  // Written under a temporary name and renamed, so readers never map a partial file
+  std::string temporary = filename+".tmp";
+  FILE *file = fopen(temporary.c_str(), "wb");
+  if (file == NULL) return;
+  BinaryHeader header;
+  header.magic = BINARY_MAGIC;
+  header.version = BINARY_VERSION;
+  header.flags = (use_column_labels ? 1 : 0) | (use_row_lables ? 2 : 0);
+  header.layout = layout;
+  header.n_rows = n_rows;
+  header.n_columns = n_columns;
+  fwrite(&header, sizeof(header), 1, file);
+  write_labels(file, column_labels);
+  write_labels(file, row_labels);
+  static const char padding[8] = {0};
+  long position = ftell(file);
+  fwrite(padding, 1, (8-position%8)%8, file);
+  fwrite(elements.data(), sizeof(double), elements.size(), file);
+  bool ok = ferror(file) == 0;
+  ok = (fclose(file) == 0) && ok;
+  if (ok) rename(temporary.c_str(), filename.c_str());
+  else remove(temporary.c_str());
 }
 
-std::vector<double> Matrix::column(int index) { // regression_score() matrix.column(col_index) in tree_node.cc // O(elements.size())
-  std::vector<double> result;
+// buffer exists and is at least as new as filename
+static bool fresh(std::string buffer, std::string filename) {
+  struct stat text, binary;
+  return stat(buffer.c_str(), &binary) == 0 &&
+         (stat(filename.c_str(), &text) != 0 ||
+          binary.st_mtim.tv_sec > text.st_mtim.tv_sec ||
+          (binary.st_mtim.tv_sec == text.st_mtim.tv_sec && binary.st_mtim.tv_nsec >= text.st_mtim.tv_nsec));
+}
+
+/*
+ * Reads filename.buffer when it is at least as new as the CSV, otherwise
+ * parses the CSV and writes the buffer for the next run.
+ * */
+void Matrix::cache_load(std::string filename, bool use_column_labels, bool use_row_lables, bool save_buffer) {
+  std::string buffer = filename+".buffer";
+  if (fresh(buffer, filename) && load_binary(buffer, use_column_labels, use_row_lables)) return;
+  load(filename, use_column_labels, use_row_lables);
+  if (save_buffer && n_rows > 0) save_binary(buffer, use_column_labels, use_row_lables);
+}
+
+void Matrix::assign(int n_rows, int n_columns, std::vector<double> &row_major_elements) { // O(rows*columns)
+  assert((long)n_rows*n_columns == row_major_elements.size());
+  Layout target = layout;
+  this->n_rows = n_rows;
+  this->n_columns = n_columns;
+  layout = ROW_MAJOR;
+  elements.swap(row_major_elements);
+  column_labels.clear();
+  row_labels.clear();
+  set_layout(target);
+  encode_classes();
+}
+
+int Matrix::rows() { return n_rows; } // O(1)
+
+int Matrix::columns() { return n_columns; } // O(1)
+
+Matrix::Layout Matrix::get_layout() { return layout; }
+
+void Matrix::set_layout(Layout layout) { // O(rows*columns) when the layout changes
+  if (this->layout == layout) return;
+  std::vector<double> transposed(elements.size());
+  for (int i = 0; i < n_rows; ++i)
+    for (int j = 0; j < n_columns; ++j) {
+      long to = (layout == COLUMN_MAJOR) ? (long)j*n_rows+i : (long)i*n_columns+j;
+      transposed[to] = at(i, j);
+    }
+  elements.swap(transposed);
+  this->layout = layout;
+}
+
+VectorView Matrix::operator[](int i) { // VectorView row = m[i] in main.cc
+  assert(i < n_rows);
+  long stride = (layout == COLUMN_MAJOR) ? n_rows : 1;
+  return VectorView(elements.data()+offset(i, 0), n_columns, stride);
+}
+
+VectorView Matrix::column(int index) { // regression_score() matrix.column(col_index) in tree_node.cc // O(1)
   if (index < 0) index += columns();
-  for (int i = 0; i < rows(); ++i) {
-    double element = elements[i][index];
-    result.push_back(element);
+  assert(index < n_columns);
+  long stride = (layout == COLUMN_MAJOR) ? 1 : n_columns;
+  return VectorView(elements.data()+offset(0, index), n_rows, stride);
+}
+
+/*
+ * Map the labels in the last column to dense ids 0..n_classes()-1 in
+ * ascending order of value. A last column with more than MAX_CLASSES
+ * distinct values is not a class column and gets no ids.
+ * */
+void Matrix::encode_classes() { // O(rows*log(MAX_CLASSES))
+  classes.clear();
+  class_ids.clear();
+  if (n_columns == 0) return;
+  VectorView y = column(-1);
+  for (int i = 0; i < n_rows; ++i) {
+    std::vector<double>::iterator it = std::lower_bound(classes.begin(), classes.end(), y[i]);
+    if (it != classes.end() && *it == y[i]) continue;
+    if (classes.size() == MAX_CLASSES) {
+      classes.clear();
+      return;
+    }
+    classes.insert(it, y[i]);
   }
-  return result;
+  class_ids.resize(n_rows);
+  for (int i = 0; i < n_rows; ++i)
+    class_ids[i] = std::lower_bound(classes.begin(), classes.end(), y[i])-classes.begin();
 }
 
+int Matrix::n_classes() { return classes.size(); }
+
 /*
  * m = [[0,1],[2,3],[4,5]]
  * m.submatrix([0,1],[1]) = [[1],[3]]
  * */
 Matrix Matrix::submatrix(std::vector<int> rows, std::vector<int> columns) { // O(rows_size*columns_size)
-  Matrix m;
+  Matrix m(layout);
   for (int j = 0; j < columns.size(); ++j)
     m.column_labels.push_back(column_labels[j]);
 
+  m.n_rows = rows.size();
+  m.n_columns = columns.size();
+  m.elements.resize((long)m.n_rows*m.n_columns);
   for (int i = 0; i < rows.size(); ++i) {
     int y = rows[i];
-    std::vector<double> row;
     m.row_labels.push_back(row_labels[y]);
     for (int j = 0; j < columns.size(); ++j) {
       int x = columns[j];
-      //printf("y=%dx=%delement=%f", y, x, elements[y][x]);
-      row.push_back(elements[y][x]);
+      //printf("y=%dx=%delement=%f", y, x, at(y, x));
+      m.at(i, j) = at(y, x);
     }
-    m.elements.push_back(row);
   }
+  m.encode_classes();
   return m;
 }
 
@@ -93,8 +500,9 @@ Matrix Matrix::submatrix(std::vector<int> rows, std::vector<int> columns) { // O
 void Matrix::split(int column_index, double value, Matrix &m1, Matrix &m2) { // O(elements.size()*elements[0].size())
   std::vector<int> m1_rows;
   std::vector<int> m2_rows;
-  for (int i = 0; i < elements.size(); ++i) {
-    double element = elements[i][column_index];
+  VectorView x = column(column_index);
+  for (int i = 0; i < n_rows; ++i) {
+    double element = x[i];
     if (element < value) m1_rows.push_back(i);
     else m2_rows.push_back(i);
   }
@@ -104,10 +512,25 @@ void Matrix::split(int column_index, double value, Matrix &m1, Matrix &m2) { //
   m2 = submatrix(m2_rows, all_cols); // m2_rows={0,1,2}, all_cols={0} matrix[m2_rows, all_cols]
 }
 
+/*
+ * Index-based split without copying rows: reorders rows[begin, end) in place
+ * so that the rows with element < value come first, and returns the index of
+ * the first row of the second part.
+ * rows = [0,1,2], column 1 = [1,2,3]
+ * m.partition(1,2,rows,0,3) = 1, rows = [0,1,2]
+ * */
+int Matrix::partition(int column_index, double value, std::vector<int> &rows, int begin, int end) { // O(end-begin)
+  VectorView x = column(column_index);
+  int middle = begin;
+  for (int i = begin; i < end; ++i)
+    if (x[rows[i]] < value) std::swap(rows[i], rows[middle++]);
+  return middle;
+}
+
 // This function returns a shuffled version of the Matrix
-Matrix Matrix::shuffled() {
+Matrix Matrix::shuffled(Random &random) {
   std::vector<int> row_indices = range(rows());
-  random_shuffle(row_indices.begin(), row_indices.end());
+  random.shuffle(row_indices);
   std::vector<int> column_indices = range(columns());
   return submatrix(row_indices, column_indices);
 }
@@ -116,34 +539,238 @@ Matrix Matrix::shuffled() {
 void Matrix::merge_rows(Matrix &other) {
   if (columns() == 0) column_labels = other.column_labels;
   assert(columns()==other.columns() || rows()==0);
-  for (int i = 0; i < other.rows(); ++i) {
-    std::vector<double> &row = other.elements[i];
-    elements.push_back(row);
-    row_labels.push_back(other.row_labels[i]);
+  if (rows() == 0) n_columns = other.n_columns;
+  if (layout == ROW_MAJOR && other.layout == ROW_MAJOR) { // Rows are whole blocks, append in place
+    elements.insert(elements.end(), other.elements.begin(), other.elements.end());
+  } else {
+    Layout original = layout;
+    std::vector<double> merged((long)(n_rows+other.n_rows)*n_columns);
+    for (int j = 0; j < n_columns; ++j) {
+      for (int i = 0; i < n_rows; ++i) merged[(long)j*(n_rows+other.n_rows)+i] = at(i, j);
+      for (int i = 0; i < other.n_rows; ++i) merged[(long)j*(n_rows+other.n_rows)+n_rows+i] = other.at(i, j);
+    }
+    elements.swap(merged);
+    layout = COLUMN_MAJOR;
+    set_layout(original);
   }
+  n_rows += other.n_rows;
+  for (int i = 0; i < other.rows(); ++i) row_labels.push_back(other.row_labels[i]);
+  encode_classes();
 }
 
 // Append a column to the right side of the Matrix
 void Matrix::append_column(std::vector<double> &col) {
   assert(col.size() == rows());
-  for (int i = 0; i < col.size(); ++i) {
-    double value = col[i];
-    elements[i].push_back(value);
+  if (layout == ROW_MAJOR) { // Every row grows by one, go through column-major storage
+    set_layout(COLUMN_MAJOR);
+    elements.insert(elements.end(), col.begin(), col.end());
+    ++n_columns;
+    set_layout(ROW_MAJOR);
+  } else {
+    elements.insert(elements.end(), col.begin(), col.end()); // The new column is one more block at the end
+    ++n_columns;
   }
+  encode_classes();
 }
 
-void Matrix::save(std::string filename, std::string name) {
-  std::ofstream file(filename.c_str());
+// The row labels and columns, under a header of the column labels and then name
+void Matrix::save(std::string filename, std::string name) { // O(rows*columns)
+  BufferedWriter file;
+  if (!file.open(filename)) return;
   // Write column header
-  column_labels.push_back(name);
-  if (column_labels.size() > 0) file << join(column_labels, ',');
-  file << '\n';
+  for (int j = 0; j < column_labels.size(); ++j) {
+    file.write(column_labels[j]);
+    file.put(',');
+  }
+  file.write(name);
+  file.put('\n');
   // Write elements
-  for (int i = 0; i < elements.size(); ++i) {
-    std::vector<double> &row = elements[i];
-    if (row_labels.size() > 0) file << row_labels[i] << ',';
-    file << join(row, ',');
-    file << '\n';
+  for (int i = 0; i < n_rows; ++i) {
+    if (row_labels.size() > 0) {
+      file.write(row_labels[i]);
+      file.put(',');
+    }
+    for (int j = 0; j < n_columns; ++j) {
+      if (j > 0) file.put(',');
+      file.write_double(at(i, j));
+    }
+    file.put('\n');
+  }
+  if (!file.close()) fprintf(stderr, "Matrix.save(): cannot write %s\n", filename.c_str());
+}
+
+/*
+ * The row labels and the given columns of rows, or of all rows, without
+ * copying them into a submatrix first. The header is the label of the row labels, when there
+ * is one, and then names.
+ * */
+void Matrix::save_columns(std::string filename, const std::vector<int> &columns, const std::vector<std::string> &names,
+                          const std::vector<int> *rows) { // O(rows*columns.size())
+  BufferedWriter file;
+  if (!file.open(filename)) return;
+  bool first = true;
+  if (row_labels.size() > 0 && column_labels.size() > 0) {
+    file.write(column_labels[0]);
+    first = false;
+  }
+  for (int j = 0; j < names.size(); ++j) {
+    if (!first) file.put(',');
+    file.write(names[j]);
+    first = false;
+  }
+  file.put('\n');
+  int n = (rows != NULL) ? rows->size() : n_rows;
+  for (int r = 0; r < n; ++r) {
+    int i = (rows != NULL) ? (*rows)[r] : r;
+    if (row_labels.size() > 0) {
+      file.write(row_labels[i]);
+      if (columns.size() > 0) file.put(',');
+    }
+    for (int j = 0; j < columns.size(); ++j) {
+      if (j > 0) file.put(',');
+      file.write_double(at(i, columns[j]));
+    }
+    file.put('\n');
+  }
+  if (!file.close()) fprintf(stderr, "Matrix.save_columns(): cannot write %s\n", filename.c_str());
+}
+
+MatrixStream::MatrixStream(size_t block_bytes) : block_bytes(block_bytes), fd(-1), data(NULL), size(0) {}
+
+MatrixStream::~MatrixStream() { close(); }
+
+void MatrixStream::close() {
+  if (fd >= 0) ::close(fd);
+  if (data != NULL) munmap((void*)data, size);
+  fd = -1;
+  data = NULL;
+  size = 0;
+  n_columns = 0;
+  n_rows = 0;
+  row = 0;
+  column_labels.clear();
+  std::vector<char>().swap(buffer);
+}
+
+bool MatrixStream::open(std::string filename, bool use_column_labels, bool use_row_lables) {
+  close();
+  this->filename = filename;
+  this->use_column_labels = use_column_labels;
+  this->use_row_lables = use_row_lables;
+  std::string binary = filename+".buffer";
+  if (fresh(binary, filename) && open_binary(binary)) return true;
+  close();
+  return open_text(filename);
+}
+
+bool MatrixStream::rewind() { return open(filename, use_column_labels, use_row_lables); }
+
+// Move the unparsed bytes to the front of buffer and read after them until it is full
+bool MatrixStream::fill() { // O(buffer size)
+  memmove(buffer.data(), buffer.data()+begin, filled-begin);
+  filled -= begin;
+  begin = 0;
+  while (filled < buffer.size() && !at_end) {
+    ssize_t n = read(fd, buffer.data()+filled, buffer.size()-filled);
+    if (n <= 0) at_end = true;
+    else filled += n;
+  }
+  return filled > 0;
+}
+
+bool MatrixStream::open_text(std::string filename) {
+  fd = ::open(filename.c_str(), O_RDONLY);
+  if (fd < 0) return false;
+  struct stat st;
+  if (fstat(fd, &st) != 0) return false;
+  buffer.resize(std::max(block_bytes, (size_t)1 << 16));
+  begin = filled = 0;
+  at_end = false;
+  line = 0;
+  if (!fill()) return false;
+  begin = read_text_header(buffer.data(), buffer.data()+filled, use_column_labels, column_labels, line, fields)-buffer.data();
+  int label_fields = use_row_lables ? 1 : 0;
+  if (fields <= label_fields) return false;
+  n_columns = fields-label_fields;
+  // Lines of the file in proportion to the lines of the first block
+  long lines = std::count(buffer.data()+begin, buffer.data()+filled, '\n');
+  n_rows = at_end ? lines : (long)((double)lines*(st.st_size-begin)/(filled-begin));
+  return true;
+}
+
+bool MatrixStream::open_binary(std::string filename) {
+  data = map_file(filename, sizeof(BinaryHeader), size);
+  if (data == NULL) return false;
+  madvise((void*)data, size, MADV_SEQUENTIAL);
+  const char *end = data+size;
+  BinaryHeader header;
+  const char *p;
+  unsigned long long count;
+  if (!read_binary_header(data, end, use_column_labels, use_row_lables, header, column_labels, p) ||
+      end-p < sizeof(count)) return false;
+  // The elements fill the end of the file, the row labels are read along with their rows
+  memcpy(&count, p, sizeof(count));
+  row_labels = p+sizeof(count);
+  long bytes = (long)header.n_rows*header.n_columns*sizeof(double);
+  if (end-row_labels < bytes || (count != 0 && count != header.n_rows)) return false;
+  elements = (const double*)(end-bytes);
+  if (count == 0) row_labels = NULL;
+  layout = (Matrix::Layout)header.layout;
+  n_rows = header.n_rows;
+  n_columns = header.n_columns;
+  return true;
+}
+
+bool MatrixStream::next(Matrix &block) { // O(block size)
+  Matrix::Layout target = block.layout;
+  if (data != NULL) {
+    int rows = std::min(n_rows-row, std::max(1L, (long)(block_bytes/sizeof(double)/std::max(1, n_columns))));
+    if (rows <= 0) return false;
+    block.n_rows = rows;
+    block.n_columns = n_columns;
+    block.layout = layout;
+    block.elements.resize((long)rows*n_columns);
+    if (layout == Matrix::ROW_MAJOR) {
+      memcpy(block.elements.data(), elements+row*n_columns, block.elements.size()*sizeof(double));
+    } else {
+      for (int j = 0; j < n_columns; ++j)
+        memcpy(&block.elements[(long)j*rows], elements+j*n_rows+row, rows*sizeof(double));
+    }
+    block.row_labels.resize(row_labels != NULL ? rows : 0);
+    for (int i = 0; row_labels != NULL && i < rows; ++i) {
+      unsigned long long length;
+      memcpy(&length, row_labels, sizeof(length));
+      row_labels += sizeof(length);
+      if ((const char*)elements-row_labels < length) return false;
+      block.row_labels[i].assign(row_labels, length);
+      row_labels += length;
+    }
+    row += rows;
+    block.column_labels = column_labels;
+    block.set_layout(target);
+    block.encode_classes();
+    return true;
+  }
+  if (fd < 0) return false;
+  block.n_rows = 0;
+  while (block.n_rows == 0) {
+    if (!fill()) return false;
+    const char *p = buffer.data();
+    const char *last = p+filled;
+    if (!at_end) { // Only whole lines, the last one may go on in the next read
+      const char *newline = (const char*)memrchr(p, '\n', filled);
+      if (newline == NULL) { // A line longer than the buffer
+        buffer.resize(buffer.size()*2);
+        continue;
+      }
+      last = newline+1;
+    }
+    line += block.parse_rows(p, last, fields, line, use_row_lables);
+    begin = last-p;
+    if (at_end && begin == filled && block.n_rows == 0) return false;
   }
-  file.close();
+  row += block.n_rows;
+  block.column_labels = column_labels;
+  block.encode_classes();
+  return true;
 }
@@ -2,26 +2,114 @@
 #define CART_MATRIX_H_
 #include <string>
 #include <vector>
+#include "cart/random.h" // Random
+#include "cart/vector_view.h" // VectorView
 
 class Matrix {
+  friend class MatrixStream;
+ public:
+  // Column-major keeps every column in sequential memory for training,
+  // row-major keeps every row in sequential memory for classification.
+  enum Layout { ROW_MAJOR, COLUMN_MAJOR };
+  // Class ids fit in one byte, so votes and leaf labels are small count arrays
+  static const int MAX_CLASSES = 256;
  private:
-  std::vector<std::vector<double> > elements;
+  std::vector<double> elements; // One contiguous block of n_rows*n_columns values
+  int n_rows;
+  int n_columns;
+  Layout layout;
   std::vector<std::string> column_labels;
   std::vector<std::string> row_labels;
+  std::vector<double> classes; // Distinct values of the last column in ascending order
+  std::vector<unsigned char> class_ids; // class_ids[i]: index in classes of the last column of row i
+  long offset(int row, int col) { // O(1)
+    if (layout == COLUMN_MAJOR) return (long)col*n_rows+row;
+    else return (long)row*n_columns+col;
+  }
+  int parse_rows(const char *body, const char *end, int fields, int first_line, bool use_row_lables);
  public:
-  Matrix();
+  Matrix(Layout layout=COLUMN_MAJOR);
   void load(std::string filename, bool use_column_labels=true, bool use_row_lables=true);
+  bool load_binary(std::string filename, bool use_column_labels=true, bool use_row_lables=true);
+  void save_binary(std::string filename, bool use_column_labels=true, bool use_row_lables=true);
+  void cache_load(std::string filename, bool use_column_labels=true, bool use_row_lables=true, bool save_buffer=true);
+  // Take over n_rows rows of n_columns values stored one row after another, without labels
+  void assign(int n_rows, int n_columns, std::vector<double> &row_major_elements);
   int rows();
   int columns();
-  std::vector<double> &operator[](int i);
-  std::vector<double> column(int index);
+  Layout get_layout();
+  const std::vector<std::string> &get_column_labels() { return column_labels; }
+  const std::vector<std::string> &get_row_labels() { return row_labels; } // Empty without row labels
+  void set_layout(Layout layout);
+  double &at(int row, int col) { return elements[offset(row, col)]; }
+  VectorView operator[](int i);
+  VectorView column(int index);
+  void encode_classes();
+  int n_classes();
+  const unsigned char *class_id_ptr() { return class_ids.data(); }
+  double class_value(int id) { return classes[id]; }
   Matrix submatrix(std::vector<int> rows, std::vector<int> columns);
   void split(int column_index, double value, Matrix &m1, Matrix &m2);
+  int partition(int column_index, double value, std::vector<int> &rows, int begin, int end);
 
-  Matrix shuffled();
+  Matrix shuffled(Random &random); // A copy, MatrixView::shuffled permutes without one
   void merge_rows(Matrix &other);
   void append_column(std::vector<double> &col);
   void save(std::string filename, std::string name="");
+  // Only the given columns, of the given rows or of all
+  void save_columns(std::string filename, const std::vector<int> &columns, const std::vector<std::string> &names,
+                    const std::vector<int> *rows=NULL);
   // Bracket overloaded operator:
 };
+
+/*
+ * Reads a CSV, or the buffer Matrix::cache_load keeps next to it when that is
+ * fresh, one block of rows at a time, so that files larger than memory can be
+ * processed block by block. Blocks hold about block_bytes of the file.
+ * */
+// Map filename read-only, or NULL if it is missing, shorter than min_size or cannot be mapped.
+// The caller unmaps the size bytes with munmap.
+const char *map_file(std::string filename, size_t min_size, size_t &size);
+
+class MatrixStream {
+ private:
+  std::string filename;
+  bool use_column_labels;
+  bool use_row_lables;
+  size_t block_bytes;
+  std::vector<std::string> column_labels;
+  int n_columns;
+  long n_rows; // Rows in the file, estimated from the first block of a CSV
+  // CSV
+  int fd;
+  std::vector<char> buffer;
+  size_t begin; // Start of the unparsed bytes in buffer
+  size_t filled;
+  bool at_end; // Nothing left to read from fd
+  int fields;
+  int line;
+  // Binary buffer, mapped
+  const char *data;
+  size_t size;
+  const char *row_labels; // Labels of the next rows
+  const double *elements;
+  Matrix::Layout layout;
+  long row; // Rows returned so far
+  bool fill();
+  bool open_text(std::string filename);
+  bool open_binary(std::string filename);
+  MatrixStream(const MatrixStream &other); // Owns a file descriptor or a mapping
+  MatrixStream &operator=(const MatrixStream &other);
+ public:
+  MatrixStream(size_t block_bytes=64<<20);
+  ~MatrixStream();
+  bool open(std::string filename, bool use_column_labels=true, bool use_row_lables=true);
+  void close();
+  // Start over from the first row
+  bool rewind();
+  // Replace block by the next rows, in the layout of block. Returns false after the last row.
+  bool next(Matrix &block);
+  int columns() { return n_columns; }
+  long estimate_rows() { return n_rows; }
+};
 #endif
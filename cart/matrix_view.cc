@@ -0,0 +1,31 @@
+#include <cassert> // assert
+#include "cart/matrix_view.h"
+#include "cart/util.h" // range
+
+MatrixView::MatrixView() : base(NULL) {}
+
+MatrixView::MatrixView(Matrix &base) : base(&base), indices(range(base.rows())) {}
+
+MatrixView::MatrixView(Matrix &base, const std::vector<int> &rows) : base(&base), indices(rows) {}
+
+MatrixView MatrixView::shuffled(Random &random) const { // O(rows)
+  MatrixView view(*this);
+  random.shuffle(view.indices);
+  return view;
+}
+
+MatrixView MatrixView::slice(int begin, int end) const { // O(end-begin)
+  assert(0 <= begin && begin <= end && end <= rows());
+  return MatrixView(*base, std::vector<int>(indices.begin()+begin, indices.begin()+end));
+}
+
+MatrixView MatrixView::concat(const MatrixView &other) const { // O(rows+other.rows)
+  assert(base == other.base || other.rows() == 0);
+  MatrixView view(*this);
+  view.indices.insert(view.indices.end(), other.indices.begin(), other.indices.end());
+  return view;
+}
+
+void MatrixView::save_columns(std::string filename, const std::vector<int> &columns, const std::vector<std::string> &names) const {
+  base->save_columns(filename, columns, names, &indices);
+}
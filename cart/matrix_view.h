@@ -0,0 +1,29 @@
+#ifndef CART_MATRIX_VIEW_H_
+#define CART_MATRIX_VIEW_H_
+#include <vector>
+#include "cart/matrix.h" // Matrix, Random
+
+/*
+ * Rows of a base Matrix picked by index: all of them, a permutation, a slice
+ * or a concatenation of views, without copying any values. The base must
+ * outlive its views.
+ * */
+class MatrixView {
+ private:
+  Matrix *base;
+  std::vector<int> indices; // indices[i]: row of base that is row i of the view
+ public:
+  MatrixView();
+  MatrixView(Matrix &base); // Every row in order, so a Matrix converts to its view
+  MatrixView(Matrix &base, const std::vector<int> &rows);
+  Matrix &matrix() const { return *base; }
+  int rows() const { return indices.size(); }
+  const std::vector<int> &row_indices() const { return indices; }
+  double &at(int row, int col) const { return base->at(indices[row], col); }
+  MatrixView shuffled(Random &random) const;
+  MatrixView slice(int begin, int end) const;
+  // The rows of this view, then those of other, over the same base
+  MatrixView concat(const MatrixView &other) const;
+  void save_columns(std::string filename, const std::vector<int> &columns, const std::vector<std::string> &names) const;
+};
+#endif
@@ -0,0 +1,112 @@
+#include <algorithm> // max
+#include <cstdio> // fopen, fwrite, rename, remove
+#include <cstring> // memcpy
+#include <sys/mman.h> // munmap
+#include "cart/matrix.h" // MAX_CLASSES, map_file
+#include "cart/model.h"
+
+static const int MODEL_MAGIC = 0x4c444f4d; // "MODL"
+static const int MODEL_VERSION = 2; // 2 adds n_columns
+
+struct ModelHeader {
+  int magic;
+  int version;
+  int n_trees;
+  int n_classes;
+  int n_columns; // Largest split column plus one
+  int unused; // Keeps the classes and nodes 8-byte aligned
+};
+
+ModelFile::ModelFile() : data(NULL), size(0), n_columns(0) {}
+
+ModelFile::~ModelFile() { close(); }
+
+void ModelFile::close() {
+  if (data != NULL) munmap((void*)data, size);
+  data = NULL;
+  size = 0;
+  n_columns = 0;
+  roots.clear();
+  sizes.clear();
+  class_values.clear();
+}
+
+// Every child offset, class id and column must stay inside the tree and the header, so classification never
+// reads out of the mapping or out of a row as wide as the header says
+static bool valid_tree(const FlatNode *nodes, unsigned long long n, int n_classes, int n_columns) { // O(n)
+  for (unsigned long long i = 0; i < n; ++i) {
+    const FlatNode &node = nodes[i];
+    if (node.column < 0) {
+      if (node.column != -1 || node.child < 0 || node.child >= n_classes) return false;
+    } else if (node.column >= n_columns || node.child <= i || node.child+1ULL >= n) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool ModelFile::open(std::string filename) { // O(nodes) validation, no copy
+  close();
+  data = map_file(filename, sizeof(ModelHeader), size);
+  if (data == NULL) {
+    size = 0;
+    return false;
+  }
+  const char *end = data+size;
+
+  ModelHeader header;
+  memcpy(&header, data, sizeof(header));
+  const char *p = data+sizeof(header);
+  bool ok = header.magic == MODEL_MAGIC && header.version == MODEL_VERSION && header.n_trees >= 0 &&
+            header.n_classes > 0 && header.n_classes <= Matrix::MAX_CLASSES && header.n_columns >= 0 &&
+            end-p >= header.n_classes*sizeof(double);
+  if (ok) {
+    class_values.assign((const double*)p, (const double*)p+header.n_classes);
+    n_columns = header.n_columns;
+    p += header.n_classes*sizeof(double);
+  }
+  for (int i = 0; ok && i < header.n_trees; ++i) {
+    unsigned long long n;
+    ok = end-p >= sizeof(n);
+    if (!ok) break;
+    memcpy(&n, p, sizeof(n));
+    p += sizeof(n);
+    ok = n > 0 && (end-p)/sizeof(FlatNode) >= n && valid_tree((const FlatNode*)p, n, header.n_classes, header.n_columns);
+    if (!ok) break;
+    roots.push_back((const FlatNode*)p);
+    sizes.push_back(n);
+    p += n*sizeof(FlatNode);
+  }
+  if (!ok || p != end) {
+    close();
+    return false;
+  }
+  return true;
+}
+
+bool ModelFile::save(std::string filename, std::vector<FlatTree> &trees, const std::vector<double> &classes) {
+  // Written under a temporary name and renamed, so readers never map a partial file
+  std::string temporary = filename+".tmp";
+  FILE *file = fopen(temporary.c_str(), "wb");
+  if (file == NULL) return false;
+  ModelHeader header;
+  header.magic = MODEL_MAGIC;
+  header.version = MODEL_VERSION;
+  header.n_trees = trees.size();
+  header.n_classes = classes.size();
+  header.n_columns = 0;
+  for (int i = 0; i < trees.size(); ++i) header.n_columns = std::max(header.n_columns, trees[i].columns());
+  header.unused = 0;
+  fwrite(&header, sizeof(header), 1, file);
+  fwrite(classes.data(), sizeof(double), classes.size(), file);
+  for (int i = 0; i < trees.size(); ++i) {
+    unsigned long long n = trees[i].count();
+    fwrite(&n, sizeof(n), 1, file);
+    fwrite(trees[i].data(), sizeof(FlatNode), n, file);
+  }
+  bool ok = ferror(file) == 0;
+  ok = (fclose(file) == 0) && ok;
+  if (ok) ok = rename(temporary.c_str(), filename.c_str()) == 0;
+  else remove(temporary.c_str());
+  return ok;
+}
@@ -0,0 +1,39 @@
+#ifndef CART_MODEL_H_
+#define CART_MODEL_H_
+#include <string>
+#include <vector>
+#include "cart/flat_tree.h" // FlatNode, FlatTree
+
+/*
+ * A trained model on disk: a header, the class values by dense id, and for
+ * every tree a uint64 node count and its FlatNodes in breadth-first order.
+ * The header records the columns a row needs, so narrower inputs are refused
+ * instead of read past.
+ * Everything is 8-byte aligned, so an opened file is used in place through
+ * the mapping and loading costs no parsing and no copy.
+ * */
+class ModelFile {
+ private:
+  const char *data;
+  size_t size;
+  std::vector<const FlatNode*> roots;
+  std::vector<int> sizes;
+  std::vector<double> class_values;
+  int n_columns;
+  ModelFile(const ModelFile &other); // The mapping has a single owner
+  ModelFile &operator=(const ModelFile &other);
+ public:
+  ModelFile();
+  ~ModelFile();
+  // Returns false if filename is missing, of another version, or damaged
+  bool open(std::string filename);
+  void close();
+  int trees() { return roots.size(); }
+  const FlatNode *nodes(int tree) { return roots[tree]; }
+  int count(int tree) { return sizes[tree]; }
+  const std::vector<double> &classes() { return class_values; }
+  // Columns a row needs to be classified by every tree, see FlatTree::columns
+  int columns() { return n_columns; }
+  static bool save(std::string filename, std::vector<FlatTree> &trees, const std::vector<double> &classes);
+};
+#endif
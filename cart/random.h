@@ -0,0 +1,46 @@
+#ifndef CART_RANDOM_H_
+#define CART_RANDOM_H_
+#include <stdint.h> // uint64_t
+#include <utility> // swap
+#include <vector>
+
+/*
+ * Counter-based random numbers: the i-th number of a stream is a hash of the
+ * stream's key and i, as in SplitMix64. A stream is split by index into
+ * independent streams, one per tree or task, which give the same numbers
+ * whichever thread draws them and in whatever order, so results depend on the
+ * seed only and not on the number of threads.
+ * */
+class Random {
+ private:
+  uint64_t key;
+  uint64_t counter; // Numbers drawn so far
+  static uint64_t mix(uint64_t z) { // O(1)
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+  }
+ public:
+  explicit Random(uint64_t seed=0) : key(mix(seed+0x9e3779b97f4a7c15ULL)), counter(0) {}
+  // Stream i of this one, independent of it and of the numbers drawn from it
+  Random split(uint64_t i) const {
+    Random stream;
+    stream.key = mix(key ^ mix(i+0x632be59bd9b4e019ULL));
+    return stream;
+  }
+  uint64_t next() { return mix(key + 0x9e3779b97f4a7c15ULL*++counter); }
+  // Uniform in [0, n), without the bias of next()%n
+  uint64_t below(uint64_t n) {
+    uint64_t threshold = -n % n; // 2^64 mod n: the numbers under it would make the low residues likelier
+    uint64_t r;
+    do r = next(); while (r < threshold);
+    return r % n;
+  }
+  // Uniform in (0, 1)
+  double uniform() { return ((next() >> 11)+0.5)/9007199254740992.0; }
+  template <class T>
+  void shuffle(std::vector<T> &v) { // O(v.size()), Fisher-Yates
+    for (long i = (long)v.size()-1; i > 0; --i) std::swap(v[i], v[below(i+1)]);
+  }
+};
+#endif
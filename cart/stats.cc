@@ -1,65 +1,117 @@
-#include <map>
-#include <vector>
+#include <algorithm> // min, max
 #include "stats.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h> // AVX2 intrinsics
+#endif
 
-double sum(const std::vector<double> &list) { // O(size)
-  double result = 0.0;
-  for (int i = 0; i < list.size(); ++i) result += list[i];
-  return result;
+int majority(const int *counts, int n) { // O(n)
+  int best = 0;
+  for (int i = 1; i < n; ++i)
+    if (counts[i] > counts[best]) best = i;
+  return best;
 }
 
-double sum_squared(const std::vector<double> &list) { // O(list.size())
-  double result = 0.0;
-  for (int i = 0; i < list.size(); ++i) result += list[i]*list[i];
-  return result;
-}
+typedef void (*BinSplitKernel)(const HistogramBin *, int, const int *, int, double, double, double, double &, int &, int &);
 
-double covariance(const std::vector<double> &dist1, const std::vector<double> &dist2) {
-  double result = 0.0;
-  for (int i = 0; i < dist1.size(); ++i) result += dist1[i]*dist2[i];
-  return result;
+// Running sums of the left side of one column, bin by bin
+static void best_bin_split_scalar(const HistogramBin *histograms, int bins, const int *n_cuts, int columns, double n,
+                                  double sum_y, double sum_y_squared, double &min_error, int &best_k, int &best_b) { // O(columns*bins)
+  for (int k = 0; k < columns; ++k) {
+    const HistogramBin *column_bins = histograms+(long)k*bins;
+    double left_n = 0.0, left_sum = 0.0, left_squared = 0.0;
+    for (int b = 0; b < n_cuts[k]; ++b) { // Split between bin b and b+1
+      const HistogramBin &bin = column_bins[b];
+      left_n += bin.count;
+      left_sum += bin.sum;
+      left_squared += bin.squared;
+      if (bin.count == 0.0 || left_n == 0.0 || left_n == n) continue;
+      double right_sum = sum_y-left_sum;
+      double error = (left_squared - left_sum*left_sum/left_n) +
+                     ((sum_y_squared-left_squared) - right_sum*right_sum/(n-left_n));
+      if (error < min_error) {
+        min_error = error;
+        best_k = k;
+        best_b = b;
+      }
+    }
+  }
 }
 
-double mode(const std::vector<double> &list) { // return the most nums in list
-  std::map<double, int> repeats;
-  for (int i =0; i < list.size(); ++i) {
-    double value = list[i];
-    if (repeats.find(value) == repeats.end()) repeats[value] = 1;
-    else repeats[value] += 1;
+#if defined(__x86_64__) || defined(__i386__)
+/*
+ * Four columns at a time, one per lane. Every lane adds up its bins in the
+ * order of the scalar kernel and computes the same error, so only the choice
+ * among the lanes is left for the end. Lanes past the last column repeat it
+ * without cut points. A bin is loaded as four doubles, the last one of the
+ * next bin, and small nodes leave most bins empty, so the errors are only
+ * computed when some lane has a split.
+ * */
+__attribute__((target("avx2")))
+static void best_bin_split_avx2(const HistogramBin *histograms, int bins, const int *n_cuts, int columns, double n,
+                                double sum_y, double sum_y_squared, double &min_error, int &best_k, int &best_b) { // O(columns*bins/4)
+  __m256d zero = _mm256_setzero_pd(), rows = _mm256_set1_pd(n);
+  __m256d total_sum = _mm256_set1_pd(sum_y), total_squared = _mm256_set1_pd(sum_y_squared);
+  for (int k = 0; k < columns; k += 4) {
+    const double *lane_bins[4];
+    int lane_cuts[4], max_cuts = 0;
+    for (int j = 0; j < 4; ++j) {
+      lane_bins[j] = &histograms[(long)std::min(k+j, columns-1)*bins].count;
+      lane_cuts[j] = (k+j < columns) ? n_cuts[k+j] : 0;
+      max_cuts = std::max(max_cuts, lane_cuts[j]);
+    }
+    __m256d cuts = _mm256_setr_pd(lane_cuts[0], lane_cuts[1], lane_cuts[2], lane_cuts[3]);
+    __m256d left_n = zero, left_sum = zero, left_squared = zero;
+    __m256d lane_error = _mm256_set1_pd(min_error), lane_b = _mm256_set1_pd(-1.0);
+    for (int b = 0; b < max_cuts; ++b) {
+      // Transpose the bins of the four columns into counts, sums and squares
+      __m256d bin0 = _mm256_loadu_pd(lane_bins[0]+3*b), bin1 = _mm256_loadu_pd(lane_bins[1]+3*b);
+      __m256d bin2 = _mm256_loadu_pd(lane_bins[2]+3*b), bin3 = _mm256_loadu_pd(lane_bins[3]+3*b);
+      __m256d low01 = _mm256_unpacklo_pd(bin0, bin1), high01 = _mm256_unpackhi_pd(bin0, bin1);
+      __m256d low23 = _mm256_unpacklo_pd(bin2, bin3), high23 = _mm256_unpackhi_pd(bin2, bin3);
+      __m256d count = _mm256_permute2f128_pd(low01, low23, 0x20);
+      __m256d sum = _mm256_permute2f128_pd(high01, high23, 0x20);
+      __m256d squared = _mm256_permute2f128_pd(low01, low23, 0x31);
+      left_n = _mm256_add_pd(left_n, count);
+      left_sum = _mm256_add_pd(left_sum, sum);
+      left_squared = _mm256_add_pd(left_squared, squared);
+      __m256d at = _mm256_set1_pd(b);
+      __m256d valid = _mm256_and_pd(_mm256_cmp_pd(count, zero, _CMP_NEQ_OQ), _mm256_cmp_pd(at, cuts, _CMP_LT_OQ));
+      valid = _mm256_and_pd(valid, _mm256_and_pd(_mm256_cmp_pd(left_n, zero, _CMP_NEQ_OQ), _mm256_cmp_pd(left_n, rows, _CMP_NEQ_OQ)));
+      if (_mm256_movemask_pd(valid) == 0) continue;
+      __m256d right_sum = _mm256_sub_pd(total_sum, left_sum);
+      __m256d left_error = _mm256_sub_pd(left_squared, _mm256_div_pd(_mm256_mul_pd(left_sum, left_sum), left_n));
+      __m256d right_error = _mm256_sub_pd(_mm256_sub_pd(total_squared, left_squared),
+                                          _mm256_div_pd(_mm256_mul_pd(right_sum, right_sum), _mm256_sub_pd(rows, left_n)));
+      __m256d error = _mm256_add_pd(left_error, right_error);
+      __m256d better = _mm256_and_pd(valid, _mm256_cmp_pd(error, lane_error, _CMP_LT_OQ));
+      lane_error = _mm256_blendv_pd(lane_error, error, better);
+      lane_b = _mm256_blendv_pd(lane_b, at, better);
+    }
+    double errors[4], at[4];
+    _mm256_storeu_pd(errors, lane_error);
+    _mm256_storeu_pd(at, lane_b);
+    for (int j = 0; j < 4 && k+j < columns; ++j) {
+      if (at[j] >= 0.0 && errors[j] < min_error) {
+        min_error = errors[j];
+        best_k = k+j;
+        best_b = (int)at[j];
+      }
+    }
   }
-  // http://stackoverflow.com/questions/9370945/c-help-finding-the-max-value-in-a-map
-  auto max = max_element(repeats.begin(), repeats.end(),
-    [](const std::pair<double, int> &p1, const std::pair<double, int> &p2) { return p1.second<p2.second; }
-  );
-  //printf("max=%f \n", (*max).first);
-  return (*max).first;
 }
+#endif
 
-void basic_linear_regression(const std::vector<double> &x, const std::vector<double> &y, double &k, double &b) { // one_variance O(rows_size*rows_size)
-  int length = x.size();
-  double sum_x = sum(x);
-  double sum_y = sum(y);
-
-  double sum_x_squared = sum_squared(x); // 计算平方和
-  double cov = covariance(x, y);
-
-  double numerator = (cov - (sum_x*sum_y)/length);
-  double denominator = ( sum_x_squared - ((sum_x*sum_x)/length) );
-  if (denominator == 0.0) k = 0.0;
-  else k = numerator/denominator;
-  b = (sum_y - k*sum_x)/length;
+static BinSplitKernel select_bin_split_kernel() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init(); // Runs before main, see below
+  if (__builtin_cpu_supports("avx2")) return best_bin_split_avx2;
+#endif
+  return best_bin_split_scalar;
 }
 
-double sum_of_squares(const std::vector<double> &x, const std::vector<double> &y, double k, double b) {
-  double result = 0.0;
-  for (int i = 0; i < x.size(); ++i) {
-    double expected = k*x[i]+b;
-    double actual = y[i];
-    double difference = expected-actual;
-    double squared = difference*difference;
-    result += squared;
-  }
-  return result;
-}
+static BinSplitKernel bin_split_kernel = select_bin_split_kernel();
 
-double mean(const std::vector<double> &list) { return sum(list)/list.size(); }
+void best_bin_split(const HistogramBin *histograms, int bins, const int *n_cuts, int columns, double n,
+                    double sum_y, double sum_y_squared, double &min_error, int &best_k, int &best_b) {
+  bin_split_kernel(histograms, bins, n_cuts, columns, n, sum_y, sum_y_squared, min_error, best_k, best_b);
+}
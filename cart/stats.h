@@ -1,9 +1,25 @@
 #ifndef CART_STATS_H_
 #define CART_STATS_H_
-#include <vector>
 
-double mode(const std::vector<double> &list);
-void basic_linear_regression(const std::vector<double> &x, const std::vector<double> &y, double &m, double &b);
-double sum_of_squares(const std::vector<double> &x, const std::vector<double> &y, double m, double b);
-double mean(const std::vector<double> &list);
+// Label sums of the rows that fall into one bin of a column
+struct HistogramBin {
+  double count;
+  double sum;
+  double squared;
+};
+
+// Index of the largest count, the first one on ties
+int majority(const int *counts, int n);
+
+/*
+ * Score the splits after every bin b < n_cuts[k] of the histograms of columns
+ * columns, histograms[k*bins+b], by the squared error of both sides of a node
+ * of n rows with label sums sum_y and sum_y_squared. The first split of least
+ * error below min_error, in order of k then b, sets min_error, best_k and
+ * best_b, which are left alone without one. Picks a vector kernel for the CPU
+ * once, with the same errors as the scalar one. It may read one bin past the
+ * last histogram.
+ * */
+void best_bin_split(const HistogramBin *histograms, int bins, const int *n_cuts, int columns, double n,
+                    double sum_y, double sum_y_squared, double &min_error, int &best_k, int &best_b);
 #endif
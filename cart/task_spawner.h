@@ -0,0 +1,37 @@
+#ifndef CART_TASK_SPAWNER_H_
+#define CART_TASK_SPAWNER_H_
+#include <pthread.h> // pthread_create, pthread_join
+#include <vector>
+
+// Hands independent pieces of work, e.g. of tree training, to a thread pool
+class TaskSpawner {
+ public:
+  // Run fn(arg) on some thread of the pool later
+  virtual void spawn(void *(*fn)(void *), void *arg) = 0;
+  virtual int threads() = 0;
+  // Wait for everything spawned so far, running queued tasks meanwhile
+  virtual void wait() = 0;
+};
+
+/*
+ * Run worker over all chunks, the first one on the calling thread. The others
+ * are tasks of spawner, or have a thread each without one, so callers size
+ * chunks by the threads they may use.
+ * */
+template <class Chunk>
+void run_chunks(std::vector<Chunk> &chunks, void *(*worker)(void *), TaskSpawner *spawner=NULL) {
+  if (spawner != NULL) {
+    for (int i = 1; i < chunks.size(); ++i) spawner->spawn(worker, &chunks[i]);
+    worker(&chunks[0]);
+    spawner->wait();
+    return;
+  }
+  std::vector<pthread_t> threads(chunks.size());
+  std::vector<char> started(chunks.size(), 0);
+  for (int i = 1; i < chunks.size(); ++i) started[i] = pthread_create(&threads[i], NULL, worker, &chunks[i]) == 0;
+  for (int i = 0; i < chunks.size(); ++i)
+    if (!started[i]) worker(&chunks[i]); // The first chunk, and those no thread could be created for
+  for (int i = 1; i < chunks.size(); ++i)
+    if (started[i]) pthread_join(threads[i], NULL);
+}
+#endif
@@ -1,79 +1,542 @@
+#include <algorithm> // sort, copy, min, max, lower_bound
+#include <atomic> // atomic
 #include <cassert>
-#include "cart/stats.h" // mode, basic_linear_regression, sum_of_squares, mean
+#include <new> // placement new
+#include <utility> // move
+#include "cart/binned_matrix.h" // BinnedMatrix
+#include "cart/flat_tree.h" // FlatTree, compile, expand
+#include "cart/matrix_view.h" // MatrixView
+#include "cart/model.h" // ModelFile
+#include "cart/stats.h" // HistogramBin, majority, best_bin_split
 #include "cart/tree_node.h"
+#include "cart/util.h" // range
 
 static double MINIMUM_GAIN = 0.001;
+// With a TaskSpawner, children with at least this many rows are trained as separate tasks
+static int SPAWN_ROWS = 4096;
+// With a TaskSpawner, nodes with at least rows*columns this large split their per-column work across tasks
+static long FAN_OUT_WORK = 1L << 18;
+
+// Nodes a NodeCursor takes from its arena at a time
+static const int CURSOR_NODES = 64;
+// Bytes a NodeArena allocates at a time
+static const size_t ARENA_BLOCK = 64*1024;
+
+NodeArena::NodeArena() : next(NULL), end(NULL) {}
+
+NodeArena::~NodeArena() {
+  for (int i = 0; i < blocks.size(); ++i) delete[] blocks[i];
+}
+
+void *NodeArena::grab(size_t bytes) { // O(1)
+  std::lock_guard<std::mutex> guard(lock);
+  if (end-next < bytes) {
+    size_t size = std::max(bytes, ARENA_BLOCK);
+    blocks.push_back(new char[size]);
+    next = blocks.back();
+    end = next+size;
+  }
+  void *result = next;
+  next += bytes;
+  return result;
+}
+
+TreeNode *NodeCursor::pair() { // O(1)
+  if (end-next < 2*sizeof(TreeNode)) {
+    next = (char*)arena->grab(CURSOR_NODES*sizeof(TreeNode));
+    end = next+CURSOR_NODES*sizeof(TreeNode);
+  }
+  TreeNode *nodes = (TreeNode*)next;
+  next += 2*sizeof(TreeNode);
+  new (&nodes[0]) TreeNode();
+  new (&nodes[1]) TreeNode();
+  return nodes;
+}
 
 TreeNode::TreeNode() { // TreeNode::train() in tree_node.cc
   left = right = NULL;
   column = -1;
   value = 1337.1337;
   classification = -1;
+  class_id = -1;
+  arena = NULL;
 }
 
-TreeNode::~TreeNode() {
-  if (left != NULL) delete left;
-  if (right != NULL) delete right;
+// The nodes below a root live in its arena, so they are freed together and never one by one
+TreeNode::~TreeNode() { delete arena; }
+
+TreeNode::TreeNode(TreeNode &&other) : arena(NULL) { *this = std::move(other); }
+
+// The nodes below stay where they are in the arena, only the root and the ownership of the arena move
+TreeNode &TreeNode::operator=(TreeNode &&other) { // O(1)
+  if (this == &other) return *this;
+  clear();
+  left = other.left;
+  right = other.right;
+  column = other.column;
+  value = other.value;
+  classification = other.classification;
+  class_id = other.class_id;
+  arena = other.arena;
+  other.arena = NULL;
+  other.clear();
+  return *this;
 }
 
-double regression_score(Matrix &matrix, int col_index) { // O(basic_linear_regression)
-  std::vector<double> x = matrix.column(col_index); // Fill the data in the col_index column to x
-  std::vector<double> y = matrix.column(-1); // Fill the last column category to y // y = {0.000000, 1.000000, 1.000000, 1.000000, 2.000000}
-  //for (auto i: x) printf("i=%f ", i);
-  double k, b;
-  basic_linear_regression(x, y, k, b);
-  double error = sum_of_squares(x, y, k, b);
-  return error;
+// Back to a root without children
+void TreeNode::clear() {
+  delete arena;
+  arena = NULL;
+  left = right = NULL;
+  column = -1;
+  value = 1337.1337;
+  classification = -1;
+  class_id = -1;
 }
 
-void TreeNode::train(Matrix &m, std::vector<int> columns) {
-  //printf("training on %s\n", join(columns, ' ').c_str());
-  // Edge cases;
-  assert(m.rows() > 0); // If wrong, stop the programming
-  assert(m.columns() > 0);
-  if (columns.size() == 0) {
-    classification = mode(m.column(-1));
-    return ;
+/*
+ * Shared state of one training run. Every node owns the same [begin, end)
+ * range of rows and of each sorted order, so a split only reorders ranges,
+ * and nodes with disjoint ranges can be trained at the same time.
+ * */
+struct TrainingSet {
+  Matrix *matrix;
+  const unsigned char *class_ids; // Dense class id of every row
+  int n_classes;
+  std::vector<int> columns;
+  std::vector<int> rows; // The rows in node order
+  std::vector<std::vector<int> > sorted; // sorted[k]: the rows of each node ordered by columns[k]
+  std::vector<char> goes_left; // Side of every row in the split being applied
+  const BinnedMatrix *bins; // Histogram mode, used instead of the sorted orders when not NULL
+  // Parallel training
+  TaskSpawner *spawner;
+  std::atomic<int> pending; // Running tasks of this tree, the last one deletes the set
+  NodeArena *arena; // Of the root
+};
+
+// Working memory of one thread of training
+struct Scratch {
+  std::vector<int> buffer; // Stable partition of sorted orders
+  std::vector<HistogramBin> histogram; // bins->bins() bins per candidate column, and one for best_bin_split to read
+  std::vector<int> n_cuts; // Cut points of the column of each histogram
+  NodeCursor nodes; // New nodes of the tree
+};
+
+// The best split found on some of the candidate columns
+struct Split {
+  double error;
+  int k; // Index in TrainingSet::columns, -1 when no split beats the node
+  double threshold;
+};
+
+// Label sums of a node
+struct NodeStats {
+  double sum_y;
+  double sum_y_squared;
+  double error;
+};
+
+// Drop the reference of a finished task to the training set
+static void release(TrainingSet *set) {
+  if (--set->pending == 0) delete set;
+}
+
+// Squared error of the labels around their mean, from the sums of n rows
+static void set_error(NodeStats &stats, int n) { // O(1)
+  stats.error = stats.sum_y_squared - stats.sum_y*stats.sum_y/n;
+}
+
+// Label sums of rows[begin, end), for the root, children get theirs from TreeNode::split
+static NodeStats label_stats(TrainingSet &set, int begin, int end) { // O(end-begin)
+  VectorView y = set.matrix->column(-1);
+  NodeStats stats = {0.0, 0.0, 0.0};
+  for (int i = begin; i < end; ++i) {
+    double label = y[set.rows[i]];
+    stats.sum_y += label;
+    stats.sum_y_squared += label*label;
   }
-  // Decide which column to split on
-  double min_error = 1000000000.0;
-  int min_index = columns[0];
-  double error = min_error;
-  for (int i = 0; i < columns.size(); ++i) {
-    int column = columns[i];
-    error = regression_score(m, column); // Calculate the linear regression for each feature
-    //printf("error=%f\n", error);
+  set_error(stats, end-begin);
+  return stats;
+}
+
+/*
+ * Sweep the rows of one node in ascending order of x once, keeping running
+ * label sums for the left side, and score every threshold between two distinct
+ * values by the squared error of both sides around their means.
+ * */
+static void best_threshold(const VectorView &x, const VectorView &y, const int *order, int n,
+                           double sum_y, double sum_y_squared, double &min_error, double &threshold) { // O(n)
+  double left_sum = 0.0, left_squared = 0.0;
+  for (int i = 0; i < n-1; ++i) {
+    double label = y[order[i]];
+    left_sum += label;
+    left_squared += label*label;
+    double a = x[order[i]], b = x[order[i+1]];
+    if (a == b) continue;
+    int left_n = i+1, right_n = n-left_n;
+    double right_sum = sum_y-left_sum;
+    double error = (left_squared - left_sum*left_sum/left_n) +
+                   ((sum_y_squared-left_squared) - right_sum*right_sum/right_n);
     if (error < min_error) {
-      min_index = column;
       min_error = error;
+      threshold = a+(b-a)/2;
+      if (threshold <= a) threshold = b; // Rows with x < threshold go left
+    }
+  }
+}
+
+/*
+ * Stream the rows of one node once, reading each label and the row's bin codes
+ * of the candidate columns [k_begin, k_end) together, and add the row to all
+ * those histograms at the same time. Every bin boundary is then scored from
+ * the running sums of the bins, which costs one pass over the node instead of
+ * one per feature.
+ * */
+static void best_histogram_split(TrainingSet &set, Scratch &scratch, int begin, int end, int k_begin, int k_end,
+                                 const NodeStats &stats, Split &best) { // O((end-begin)*columns+columns*bins)
+  Matrix &m = *set.matrix;
+  const BinnedMatrix &binned = *set.bins;
+  const int *columns = set.columns.data();
+  int bins = binned.bins();
+  VectorView y = m.column(-1);
+  std::vector<HistogramBin> &histogram = scratch.histogram;
+  HistogramBin empty = {0.0, 0.0, 0.0};
+  histogram.assign((k_end-k_begin)*bins+1, empty);
+  for (int i = begin; i < end; ++i) {
+    int row = set.rows[i];
+    double label = y[row];
+    const unsigned char *codes = binned.row(row);
+    HistogramBin *column_bins = histogram.data();
+    for (int k = k_begin; k < k_end; ++k, column_bins += bins) {
+      HistogramBin &bin = column_bins[codes[columns[k]]];
+      bin.count += 1.0;
+      bin.sum += label;
+      bin.squared += label*label;
+    }
+  }
+  scratch.n_cuts.resize(k_end-k_begin);
+  for (int k = k_begin; k < k_end; ++k) scratch.n_cuts[k-k_begin] = binned.cuts(columns[k]).size();
+  int k = -1, b = -1;
+  best_bin_split(histogram.data(), bins, scratch.n_cuts.data(), k_end-k_begin, end-begin, stats.sum_y, stats.sum_y_squared,
+                 best.error, k, b);
+  if (k >= 0) {
+    best.k = k_begin+k;
+    best.threshold = binned.cuts(columns[best.k])[b]; // The real value, so classification needs no bins
+  }
+}
+
+// Move the rows with goes_left set to the front of order[begin, end), keeping their order
+static void stable_partition(std::vector<int> &order, int begin, int end, std::vector<char> &goes_left, std::vector<int> &buffer) { // O(end-begin)
+  int middle = begin;
+  buffer.clear();
+  for (int i = begin; i < end; ++i) {
+    int row = order[i];
+    if (goes_left[row]) order[middle++] = row;
+    else buffer.push_back(row);
+  }
+  std::copy(buffer.begin(), buffer.end(), order.begin()+middle);
+}
+
+// Sort the rows by the candidate columns [k_begin, k_end)
+static void prepare_columns(TrainingSet &set, int k_begin, int k_end) { // O(rows*log(rows)) per column
+  Matrix &m = *set.matrix;
+  for (int k = k_begin; k < k_end; ++k) {
+    VectorView x = m.column(set.columns[k]);
+    set.sorted[k] = set.rows;
+    std::sort(set.sorted[k].begin(), set.sorted[k].end(), [&x](int a, int b) { return x[a] < x[b]; });
+  }
+}
+
+// Best split of rows[begin, end) on the candidate columns [k_begin, k_end)
+static void search_columns(TrainingSet &set, Scratch &scratch, int begin, int end, int k_begin, int k_end,
+                           const NodeStats &stats, Split &best) { // O((end-begin)*(k_end-k_begin))
+  if (set.bins != NULL) {
+    best_histogram_split(set, scratch, begin, end, k_begin, k_end, stats, best);
+    return ;
+  }
+  Matrix &m = *set.matrix;
+  VectorView y = m.column(-1); // Labels
+  for (int k = k_begin; k < k_end; ++k) {
+    double error = best.error;
+    double threshold = 0.0;
+    best_threshold(m.column(set.columns[k]), y, &set.sorted[k][begin], end-begin, stats.sum_y, stats.sum_y_squared, error, threshold);
+    //printf("error=%f\n", error);
+    if (error < best.error) {
+      best.k = k;
+      best.error = error;
+      best.threshold = threshold;
+    }
+  }
+}
+
+// Apply the split marked in goes_left to the sorted orders of the candidate columns [k_begin, k_end)
+static void partition_columns(TrainingSet &set, Scratch &scratch, int begin, int end, int k_begin, int k_end) { // O((end-begin)*(k_end-k_begin))
+  if (set.bins != NULL) return; // Histogram mode keeps no sorted orders
+  for (int k = k_begin; k < k_end; ++k)
+    stable_partition(set.sorted[k], begin, end, set.goes_left, scratch.buffer);
+}
+
+static bool fans_out(TrainingSet &set, int begin, int end) {
+  return set.spawner != NULL && set.columns.size() > 1 && (long)(end-begin)*set.columns.size() >= FAN_OUT_WORK;
+}
+
+/*
+ * Per-column work of one large node spread across tasks. Each phase runs one
+ * chunk of the candidate columns per task, and the task that finishes the last
+ * chunk carries the node on to the next phase, so no thread ever blocks.
+ * */
+struct NodeJob {
+  enum Phase { PREPARE, SEARCH, PARTITION };
+  Phase phase;
+  TrainingSet *set;
+  TreeNode *node;
+  int begin;
+  int end;
+  int middle;
+  NodeStats stats;
+  NodeStats children[2]; // Of [begin, middle) and [middle, end), filled by the split
+  int n_chunks;
+  std::vector<Split> results; // Best split of every chunk
+  std::atomic<int> remaining; // Chunks of the phase still running
+
+  void start(Phase phase);
+  void run_chunk(int chunk);
+  void finish_phase();
+};
+
+struct ChunkTask {
+  NodeJob *job;
+  int chunk;
+};
+
+static void *chunk_thread(void *arg) {
+  ChunkTask *task = (ChunkTask*)arg;
+  TrainingSet *set = task->job->set;
+  task->job->run_chunk(task->chunk);
+  delete task;
+  release(set);
+  return NULL;
+}
+
+// Spread the phase over tasks, the calling thread runs the first chunk itself
+void NodeJob::start(Phase phase) {
+  this->phase = phase;
+  int n_columns = set->columns.size();
+  n_chunks = std::max(1, std::min(set->spawner->threads(), n_columns));
+  results.resize(n_chunks);
+  remaining = n_chunks;
+  for (int chunk = 1; chunk < n_chunks; ++chunk) {
+    ChunkTask *task = new ChunkTask;
+    task->job = this;
+    task->chunk = chunk;
+    ++set->pending;
+    set->spawner->spawn(chunk_thread, task);
+  }
+  run_chunk(0);
+}
+
+void NodeJob::run_chunk(int chunk) {
+  int n_columns = set->columns.size();
+  int k_begin = (long)n_columns*chunk/n_chunks, k_end = (long)n_columns*(chunk+1)/n_chunks;
+  Scratch scratch;
+  if (phase == PREPARE) prepare_columns(*set, k_begin, k_end);
+  else if (phase == SEARCH) {
+    results[chunk].error = stats.error;
+    results[chunk].k = -1;
+    search_columns(*set, scratch, begin, end, k_begin, k_end, stats, results[chunk]);
+  } else partition_columns(*set, scratch, begin, end, k_begin, k_end);
+  if (--remaining == 0) finish_phase();
+}
+
+void NodeJob::finish_phase() {
+  Scratch scratch;
+  if (phase == PREPARE) { // The sorted orders are ready, train the root
+    TrainingSet *set = this->set;
+    TreeNode *root = node;
+    delete this;
+    root->train(*set, scratch, 0, set->rows.size(), label_stats(*set, 0, set->rows.size()));
+    return ;
+  }
+  if (phase == SEARCH) {
+    Split best = results[0]; // Chunks are reduced in column order, like the serial search
+    for (int chunk = 1; chunk < n_chunks; ++chunk)
+      if (results[chunk].error < best.error) best = results[chunk];
+    middle = node->split(*set, begin, end, stats, best, children);
+    if (middle < 0) { // Leaf
+      delete this;
+      return ;
     }
+    if (set->bins == NULL) {
+      start(PARTITION);
+      return ;
+    }
+  }
+  TrainingSet *set = this->set;
+  TreeNode *node = this->node;
+  int begin = this->begin, middle = this->middle, end = this->end;
+  NodeStats children[2] = {this->children[0], this->children[1]};
+  delete this;
+  node->grow(*set, scratch, begin, middle, end, children);
+}
+
+struct SubtreeTask {
+  TrainingSet *set;
+  TreeNode *node;
+  int begin;
+  int end;
+  NodeStats stats;
+  void run(Scratch &scratch) { node->train(*set, scratch, begin, end, stats); }
+};
+
+static void *subtree_thread(void *arg) {
+  SubtreeTask *task = (SubtreeTask*)arg;
+  Scratch scratch;
+  task->run(scratch);
+  TrainingSet *set = task->set;
+  delete task;
+  release(set);
+  return NULL;
+}
+
+void TreeNode::train(const MatrixView &view, std::vector<int> columns, const BinnedMatrix *bins, TaskSpawner *spawner) {
+  //printf("training on %s\n", join(columns, ' ').c_str());
+  Matrix &m = view.matrix();
+  int n_rows = view.rows();
+  // Edge cases;
+  assert(n_rows > 0); // If wrong, stop the programming
+  assert(m.columns() > 0);
+  assert(m.n_classes() > 0); // The last column holds at most Matrix::MAX_CLASSES classes
+  assert(bins == NULL || bins->rows() == m.rows());
+  clear();
+  arena = new NodeArena;
+  TrainingSet *set = new TrainingSet;
+  set->arena = arena;
+  set->matrix = &m;
+  set->class_ids = m.class_id_ptr();
+  set->n_classes = m.n_classes();
+  arena->classes.resize(m.n_classes());
+  for (int i = 0; i < m.n_classes(); ++i) arena->classes[i] = m.class_value(i);
+  set->columns = columns;
+  set->rows = view.row_indices(); // Rows of the base matrix, the others are never read
+  set->bins = bins;
+  set->spawner = spawner;
+  set->pending = 1;
+  if (bins == NULL) {
+    // Sort the rows by each candidate column once, splits keep every order sorted
+    set->sorted.resize(columns.size());
+    set->goes_left.resize(m.rows());
+  }
+  if (bins == NULL && fans_out(*set, 0, n_rows)) {
+    NodeJob *job = new NodeJob;
+    job->set = set;
+    job->node = this;
+    job->start(NodeJob::PREPARE);
+  } else {
+    if (bins == NULL) prepare_columns(*set, 0, columns.size()); // The bins are shared and ready
+    Scratch scratch;
+    train(*set, scratch, 0, n_rows, label_stats(*set, 0, n_rows));
   }
-  // Split on lowest error-column
-  double v = mean(m.column(min_index)); // Calculate the average
-  Matrix l, r;
-  m.split(min_index, v, l, r); // Take the min_index column, less than v fill to the left subtree, else fill to the right subtree
-  if (l.rows()<=0 || r.rows()<=0) {
-    //printf("l or r: 0 rows \n");
-    classification = mode(m.column(-1)); // Predict
+  release(set);
+}
+
+void TreeNode::train(TrainingSet &set, Scratch &scratch, int begin, int end, const NodeStats &stats) {
+  if (set.columns.size() == 0) {
+    label_leaf(set, begin, end);
     return ;
   }
-  double left_error = regression_score(l, min_index);
-  double right_error = regression_score(r, min_index);
-  //printf("m_e=%f,l=%f,r=%f,v=%f\n", min_error, left_error, right_error, v);
-  double gain = min_error-(left_error-right_error);
-  if (gain < MINIMUM_GAIN) {
-    //printf("split on min gain: %f %f %f", left_error, right_error, gain);
-    classification = mode(m.column(-1));
+  if (fans_out(set, begin, end)) {
+    NodeJob *job = new NodeJob;
+    job->set = &set;
+    job->node = this;
+    job->begin = begin;
+    job->end = end;
+    job->stats = stats;
+    job->start(NodeJob::SEARCH);
     return ;
   }
+  // Decide which column and threshold to split on
+  Split best;
+  best.error = stats.error;
+  best.k = -1;
+  best.threshold = 0.0;
+  search_columns(set, scratch, begin, end, 0, set.columns.size(), stats, best);
+  NodeStats children[2];
+  int middle = split(set, begin, end, stats, best, children);
+  if (middle < 0) return ;
+  partition_columns(set, scratch, begin, end, 0, set.columns.size());
+  grow(set, scratch, begin, middle, end, children);
+}
+
+/*
+ * Turn this node into a leaf when the best split gains too little and return
+ * -1, else split rows[begin, end) on it and return the first row of the right
+ * side, with the label sums of both sides in children. The sorted orders are
+ * left to partition_columns.
+ * */
+int TreeNode::split(TrainingSet &set, int begin, int end, const NodeStats &stats, const Split &best,
+                    NodeStats *children) { // O(end-begin)
+  double gain = stats.error-best.error;
+  if (best.k == -1 || gain < MINIMUM_GAIN) {
+    //printf("split on min gain: %f %f", stats.error, gain);
+    label_leaf(set, begin, end); // Predict
+    return -1;
+  }
+  Matrix &m = *set.matrix;
+  int min_index = set.columns[best.k];
+  double v = best.threshold;
+  // Less than v moves to [begin, middle) for the left subtree, else to [middle, end)
+  int middle = m.partition(min_index, v, set.rows, begin, end);
+  VectorView y = m.column(-1);
+  for (int side = 0; side < 2; ++side) {
+    int side_begin = side == 0 ? begin : middle, side_end = side == 0 ? middle : end;
+    NodeStats &sums = children[side];
+    sums.sum_y = sums.sum_y_squared = 0.0;
+    for (int i = side_begin; i < side_end; ++i) {
+      int row = set.rows[i];
+      double label = y[row];
+      sums.sum_y += label;
+      sums.sum_y_squared += label*label;
+      if (set.bins == NULL) set.goes_left[row] = side == 0;
+    }
+    set_error(sums, side_end-side_begin);
+  }
   column = min_index;
   value = v;
-  // train child nodes in tree
-  left = new TreeNode();
-  left->train(l, columns);
-  right = new TreeNode();
-  right->train(r, columns);
   //printf("Splitting on column %d with value %f\n", min_index, value);
+  return middle;
+}
+
+// Train the children on [begin, middle) and [middle, end), large ones as separate tasks
+void TreeNode::grow(TrainingSet &set, Scratch &scratch, int begin, int middle, int end, const NodeStats *stats) {
+  // train child nodes in tree
+  if (scratch.nodes.arena != set.arena) scratch.nodes = NodeCursor(set.arena);
+  left = scratch.nodes.pair();
+  right = left+1;
+  TreeNode *children[2] = {left, right};
+  int ranges[3] = {begin, middle, end};
+  for (int i = 0; i < 2; ++i) {
+    if (set.spawner != NULL && ranges[i+1]-ranges[i] >= SPAWN_ROWS) {
+      SubtreeTask *task = new SubtreeTask;
+      task->set = &set;
+      task->node = children[i];
+      task->begin = ranges[i];
+      task->end = ranges[i+1];
+      task->stats = stats[i];
+      ++set.pending;
+      set.spawner->spawn(subtree_thread, task);
+    } else {
+      children[i]->train(set, scratch, ranges[i], ranges[i+1], stats[i]);
+    }
+  }
+}
+
+// Label a leaf with the most frequent class of its rows, counted by class id
+void TreeNode::label_leaf(TrainingSet &set, int begin, int end) { // O(end-begin)
+  int counts[Matrix::MAX_CLASSES];
+  std::fill(counts, counts+set.n_classes, 0);
+  for (int i = begin; i < end; ++i) ++counts[set.class_ids[set.rows[i]]];
+  class_id = majority(counts, set.n_classes);
+  classification = set.matrix->class_value(class_id);
 }
 
 int TreeNode::count() {
@@ -83,8 +546,61 @@ int TreeNode::count() {
   return result;
 }
 
-int TreeNode::classify(std::vector<double> &row) { // root.classify() in main.cc
+void TreeNode::remap(const std::vector<int> &columns, Matrix &trained, const std::vector<double> &classes) { // O(nodes*log(classes))
+  if (arena != NULL) arena->classes = classes; // The root
+  if (left == NULL) { // By the exact class value, classification is truncated
+    class_id = std::lower_bound(classes.begin(), classes.end(), trained.class_value(class_id))-classes.begin();
+    return;
+  }
+  column = columns[column];
+  left->remap(columns, trained, classes);
+  right->remap(columns, trained, classes);
+}
+
+bool TreeNode::save(std::string filename) { // O(nodes)
+  if (arena == NULL) return false; // Neither trained nor loaded
+  std::vector<FlatTree> trees(1);
+  trees[0].compile(*this);
+  return ModelFile::save(filename, trees, arena->classes);
+}
+
+bool TreeNode::load(std::string filename) { // O(nodes)
+  ModelFile model;
+  if (!model.open(filename) || model.trees() != 1) return false;
+  FlatTree tree;
+  tree.map(model.nodes(0), model.count(0));
+  tree.expand(*this);
+  arena->classes = model.classes();
+  return true;
+}
+
+int TreeNode::classify(const VectorView &row) { // root.classify() in main.cc
   if (classification != -1) return classification;
   if (row[column] < value) return left->classify(row);
   else return right->classify(row);
 }
+
+// Walk blocks of rows down the tree together so that their pointer loads overlap
+void TreeNode::classify_batch(Matrix &m, const int *rows, int n, int *out) { // O(n*depth)
+  static const int BLOCK = 16;
+  for (int start = 0; start < n; start += BLOCK) {
+    int count = std::min(BLOCK, n-start);
+    TreeNode *node[BLOCK];
+    int row[BLOCK];
+    for (int j = 0; j < count; ++j) {
+      node[j] = this;
+      row[j] = (rows != NULL) ? rows[start+j] : start+j;
+    }
+    bool active = true;
+    while (active) {
+      active = false;
+      for (int j = 0; j < count; ++j) {
+        TreeNode *p = node[j];
+        if (p->left == NULL) continue;
+        node[j] = (m.at(row[j], p->column) < p->value) ? p->left : p->right;
+        active = true;
+      }
+    }
+    for (int j = 0; j < count; ++j) out[start+j] = node[j]->classification;
+  }
+}
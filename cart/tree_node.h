@@ -1,20 +1,87 @@
 #ifndef CART_TREE_NODE_H_
 #define CART_TREE_NODE_H_
+#include <mutex> // mutex
 #include <string>
 #include "cart/classifier.h"
+#include "cart/task_spawner.h" // TaskSpawner
+
+class BinnedMatrix;
+class MatrixView;
+struct TrainingSet;
+struct Scratch;
+struct Split;
+struct NodeStats;
+struct NodeJob;
+struct SubtreeTask;
+
+class TreeNode;
+
+/*
+ * Storage of all nodes below one root. Threads take chunks of it under the
+ * lock and bump a NodeCursor through them without locking, and the whole tree
+ * is freed at once with the arena.
+ * */
+class NodeArena {
+ private:
+  std::mutex lock;
+  std::vector<char*> blocks;
+  char *next;
+  char *end;
+ public:
+  std::vector<double> classes; // Class value of every class id of the tree, exact unlike classification
+  NodeArena();
+  ~NodeArena();
+  void *grab(size_t bytes);
+};
+
+// The part of a NodeArena that one thread allocates from
+struct NodeCursor {
+  NodeArena *arena;
+  char *next;
+  char *end;
+  NodeCursor(NodeArena *arena=NULL) : arena(arena), next(NULL), end(NULL) {}
+  // Two new sibling nodes side by side
+  TreeNode *pair();
+};
 
 class TreeNode : public Classifier{
+  friend class FlatTree;
+  friend struct NodeJob;
+  friend struct SubtreeTask;
  private:
   TreeNode *left;
   TreeNode *right;
   int column;
   double value;
   int classification;
+  int class_id; // Dense id of classification in the training Matrix
+  NodeArena *arena; // Holds all nodes below a root, NULL in those nodes
+  void clear();
+  void label_leaf(TrainingSet &set, int begin, int end);
+  void train(TrainingSet &set, Scratch &scratch, int begin, int end, const NodeStats &stats);
+  int split(TrainingSet &set, int begin, int end, const NodeStats &stats, const Split &best, NodeStats *children);
+  void grow(TrainingSet &set, Scratch &scratch, int begin, int middle, int end, const NodeStats *stats);
  public:
   TreeNode();
   ~TreeNode();
-  void train(Matrix &m, std::vector<int> columns);
+  // A root owns its arena, so it moves, e.g. within a std::vector, but is not copied
+  TreeNode(TreeNode &&other);
+  TreeNode &operator=(TreeNode &&other);
+  TreeNode(const TreeNode &other) = delete;
+  TreeNode &operator=(const TreeNode &other) = delete;
+  // Train on the rows of view, a whole Matrix converts to one. With bins of its base matrix, splits
+  // are scored on the histograms of the binned columns, else on every distinct value. With a spawner,
+  // large subtrees and the per-column work of large nodes run as tasks on it, and the tree is only
+  // complete once all of them have run, e.g. after pool_wait.
+  void train(const MatrixView &view, std::vector<int> columns, const BinnedMatrix *bins=NULL, TaskSpawner *spawner=NULL);
   int count();
-  virtual int classify(std::vector<double> &row);
+  // Point a tree trained on trained, a projection of a matrix, back at the matrix: split column c
+  // becomes columns[c], and the class id of every leaf becomes the index of its class value in classes
+  void remap(const std::vector<int> &columns, Matrix &trained, const std::vector<double> &classes);
+  // A model file holding this tree alone, see ModelFile
+  bool save(std::string filename);
+  bool load(std::string filename);
+  virtual int classify(const VectorView &row);
+  virtual void classify_batch(Matrix &m, const int *rows, int n, int *out);
 };
 #endif
@@ -0,0 +1,27 @@
+#ifndef CART_VECTOR_VIEW_H_
+#define CART_VECTOR_VIEW_H_
+#include <cstddef> // NULL
+#include <vector>
+
+// A non-owning view of a row or a column of a Matrix.
+// Elements are `stride` doubles apart, a stride of 1 means sequential memory.
+class VectorView {
+ private:
+  const double *data;
+  int length;
+  long stride;
+ public:
+  VectorView() : data(NULL), length(0), stride(1) {}
+  VectorView(const double *data, int length, long stride=1) : data(data), length(length), stride(stride) {}
+  VectorView(const std::vector<double> &list) : data(list.data()), length(list.size()), stride(1) {}
+  int size() const { return length; }
+  bool contiguous() const { return stride == 1; }
+  const double *begin_ptr() const { return data; }
+  double operator[](int i) const { return data[i*stride]; }
+  std::vector<double> to_vector() const { // O(length)
+    std::vector<double> result(length);
+    for (int i = 0; i < length; ++i) result[i] = data[i*stride];
+    return result;
+  }
+};
+#endif
@@ -0,0 +1,105 @@
+#include <algorithm> // min
+#include <cmath> // fabs, floor, log10, nearbyint, pow, signbit
+#include <cstdio> // snprintf
+#include <cstring> // memcpy
+#include <fcntl.h> // open
+#include <unistd.h> // write, close
+#include "cart/writer.h"
+
+BufferedWriter::BufferedWriter(size_t capacity) : fd(-1), buffer(capacity > 64 ? capacity : 64), used(0), failed(false) {}
+
+BufferedWriter::~BufferedWriter() { close(); }
+
+bool BufferedWriter::open(std::string filename) {
+  close();
+  fd = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  failed = fd < 0;
+  return !failed;
+}
+
+void BufferedWriter::flush() {
+  for (size_t done = 0; done < used && !failed; ) {
+    ssize_t n = ::write(fd, buffer.data()+done, used-done);
+    if (n <= 0) failed = true;
+    else done += n;
+  }
+  used = 0;
+}
+
+bool BufferedWriter::close() {
+  if (fd < 0) return !failed;
+  flush();
+  if (::close(fd) != 0) failed = true;
+  fd = -1;
+  return !failed;
+}
+
+void BufferedWriter::write(const char *s, size_t n) {
+  while (n > 0) {
+    if (used == buffer.size()) flush();
+    size_t count = std::min(n, buffer.size()-used);
+    memcpy(buffer.data()+used, s, count);
+    used += count;
+    s += count;
+    n -= count;
+  }
+}
+
+void BufferedWriter::write_int(long value) { // O(digits)
+  char digits[24];
+  int n = 0;
+  unsigned long magnitude = (value < 0) ? -(unsigned long)value : value;
+  do {
+    digits[n++] = '0'+magnitude%10;
+    magnitude /= 10;
+  } while (magnitude > 0);
+  if (value < 0) put('-');
+  while (n > 0) put(digits[--n]);
+}
+
+/*
+ * %g keeps 6 significant digits and drops trailing zeros. Values from 1e-4 to
+ * below 1e6 print without an exponent, so their digits are the value scaled to
+ * 6 digits and rounded. Rounding a scaled double can differ from printf, which
+ * rounds the exact binary value, only near a tie, so those values and all
+ * others go through snprintf.
+ * */
+void BufferedWriter::write_double(double value) {
+  double magnitude = fabs(value);
+  if (magnitude < 1e6 && value == (long)value && !std::signbit(value)) { // Integers, e.g. class labels and ids
+    write_int((long)value);
+    return;
+  }
+  if (magnitude >= 1e-4 && magnitude < 1e6) {
+    int exponent = (int)floor(log10(magnitude));
+    int decimals = 5-exponent;
+    double scaled = magnitude*pow(10.0, decimals);
+    double digits = nearbyint(scaled);
+    bool exponent_form = digits >= 1e6 && exponent == 5; // Rounds to 1e+06
+    if (fabs(fabs(scaled-digits)-0.5) > 1e-6 && !exponent_form) {
+      if (digits >= 1e6) { // Rounded up to the next power of ten, e.g. 9.999999
+        --decimals;
+        digits = nearbyint(scaled/10.0);
+      }
+      long integer = (long)digits;
+      while (decimals > 0 && integer%10 == 0) { // Trailing zeros
+        integer /= 10;
+        --decimals;
+      }
+      char text[32];
+      int n = 0;
+      for (int i = 0; i < decimals; ++i, integer /= 10) text[n++] = '0'+integer%10;
+      if (decimals > 0) text[n++] = '.';
+      do {
+        text[n++] = '0'+integer%10;
+        integer /= 10;
+      } while (integer > 0);
+      if (value < 0) put('-');
+      while (n > 0) put(text[--n]);
+      return;
+    }
+  }
+  char text[32];
+  int n = snprintf(text, sizeof(text), "%g", value);
+  write(text, n);
+}
@@ -0,0 +1,36 @@
+#ifndef CART_WRITER_H_
+#define CART_WRITER_H_
+#include <string>
+#include <vector>
+
+/*
+ * Text output through one large buffer with number formatting that needs no
+ * streams. Numbers print like std::ostream with its default precision, so
+ * files keep the format Matrix::save always had.
+ * */
+class BufferedWriter {
+ private:
+  int fd;
+  std::vector<char> buffer;
+  size_t used;
+  bool failed;
+  void flush();
+  BufferedWriter(const BufferedWriter &other); // Owns a file descriptor
+  BufferedWriter &operator=(const BufferedWriter &other);
+ public:
+  BufferedWriter(size_t capacity=1<<20);
+  ~BufferedWriter();
+  bool open(std::string filename);
+  // Flush and close, returns false if any write failed
+  bool close();
+  void put(char c) {
+    if (used == buffer.size()) flush();
+    buffer[used++] = c;
+  }
+  void write(const char *s, size_t n);
+  void write(const std::string &s) { write(s.data(), s.size()); }
+  void write_int(long value);
+  // Same text as std::ostream << value, that is printf("%g")
+  void write_double(double value);
+};
+#endif
@@ -1,5 +1,10 @@
+#include <algorithm> // fill, min, max, lower_bound, sort, swap
+#include <cassert> // assert
+#include <cmath> // log
 #include <cstdio>
-#include "cart/stats.h" // mode
+#include <mutex> // mutex, lock_guard
+#include "cart/random.h" // Random, split, below, shuffle
+#include "cart/stats.h" // majority
 #include "cart/util.h" // range, slice
 #include "random_forest/forest.h"
 
@@ -9,27 +14,323 @@ Forest::Forest(int n_trees, int n_features) { init(n_trees, n_features); }
 void Forest::init(int n_trees, int n_features) {
   this->n_trees = n_trees;
   this->n_features = n_features;
+  this->max_bins = 0;
+  this->bag_fraction = 0.0;
+  this->bag_replace = true;
+  this->seed = 0;
+  this->oob_percent = -1.0;
+  this->n_columns = 0;
 
-  for (int i = 0; i < n_trees; ++i) trees.push_back(TreeNode());
+  trees.clear();
+  trees.resize(n_trees);
 }
 
-void Forest::train(Matrix &m) {
+void Forest::set_max_bins(int max_bins) {
+  assert(max_bins == 0 || (max_bins > 1 && max_bins <= BinnedMatrix::MAX_BINS));
+  this->max_bins = max_bins;
+}
+
+void Forest::set_bagging(double fraction, bool replace) {
+  assert(fraction >= 0.0 && (fraction <= 1.0 || replace));
+  bag_fraction = fraction;
+  bag_replace = replace;
+}
+
+void Forest::set_seed(uint64_t seed) { this->seed = seed; }
+
+void Forest::set_classes(Matrix &m) {
+  classes.resize(m.n_classes());
+  for (int i = 0; i < classes.size(); ++i) classes[i] = m.class_value(i);
+}
+
+void Forest::train(Matrix &m) { train(MatrixView(m)); }
+
+// fraction of the rows of view, drawn with or without replacement, in the order of the base matrix
+static MatrixView bag(const MatrixView &view, double fraction, bool replace, Random &random) { // O(n*log(n))
+  const std::vector<int> &all = view.row_indices();
+  int n = std::max(1, (int)(fraction*all.size()+0.5));
+  std::vector<int> rows(n);
+  if (replace) {
+    for (int i = 0; i < n; ++i) rows[i] = all[random.below(all.size())];
+  } else { // The first n steps of a Fisher-Yates shuffle
+    std::vector<int> pool(all);
+    for (int i = 0; i < n; ++i) {
+      std::swap(pool[i], pool[i + random.below(pool.size()-i)]);
+      rows[i] = pool[i];
+    }
+  }
+  std::sort(rows.begin(), rows.end()); // Walk the base matrix forward
+  return MatrixView(view.matrix(), rows);
+}
+
+// n_features of the features of a matrix of n_columns columns, at most all of them, drawn first from a tree's stream
+static std::vector<int> draw_columns(int n_columns, int n_features, Random &random) { // O(columns)
+  std::vector<int> all_columns = range(n_columns-1);
+  random.shuffle(all_columns);
+  return slice(all_columns, 0, std::min(n_features, (int)all_columns.size())); // 训练列数
+}
+
+// Tree i draws from stream i of the seed alone, so the trees can draw in any order on any thread
+void Forest::draw_tree(int i, const MatrixView &view, std::vector<int> &columns, MatrixView *bag) { // O(columns+n*log(n))
+  Random random = Random(seed).split(i);
+  columns = draw_columns(view.matrix().columns(), n_features, random);
+  if (bag != NULL && bag_fraction > 0.0) *bag = ::bag(view, bag_fraction, bag_replace, random);
+}
+
+void Forest::bin(const MatrixView &view, BinnedMatrix &binned) { binned.build(view, max_bins); }
+
+void Forest::train(const MatrixView &view) {
   //printf("forest training %lu %d\n", trees.size(), n_trees);
-  std::vector<int> all_columns = range(m.columns()-1);
+  subsets.assign(trees.size(), std::vector<int>());
+  for (int i = 0; i < trees.size(); ++i) draw_tree(i, view, subsets[i], NULL); // The bags are drawn by the trees
+  Matrix &m = view.matrix();
+  set_classes(m);
+  BinnedMatrix binned; // Binned once for all trees
+  if (max_bins > 0) bin(view, binned);
+  std::vector<const MatrixView*> views(trees.size(), &view);
+  std::vector<BinnedMatrix*> bins(trees.size(), (max_bins > 0) ? &binned : NULL);
+  train_trees(views, bins, subsets, 0, bag_fraction > 0.0);
+  compile();
+  score_out_of_bag(view);
+}
+
+void Forest::train_trees(std::vector<const MatrixView*> &views, std::vector<BinnedMatrix*> &bins,
+                         std::vector<std::vector<int> > &columns, int first, bool bagged) {
+  for (int i = 0; i < views.size(); ++i) {
+    if (!bagged) {
+      trees[first+i].train(*views[i], columns[i], bins[i]);
+      continue;
+    }
+    MatrixView bag;
+    std::vector<int> drawn;
+    draw_tree(first+i, *views[i], drawn, &bag);
+    trees[first+i].train(bag, columns[i], bins[i]);
+  }
+}
+
+/*
+ * Votes of the trees for the rows of a view, by class id. Trees add theirs
+ * as they are scored, from any thread, each block of rows under its own lock,
+ * so no tree's rows outlive its scoring.
+ * */
+struct OutOfBagVotes {
+  static const int BLOCK = 4096; // Rows per lock
+  int n_classes;
+  std::vector<int> votes; // votes[k*n_classes+id]
+  std::vector<int> n_votes; // Trees that scored row k
+  std::vector<std::mutex> locks;
+  OutOfBagVotes(int n_rows, int n_classes)
+    : n_classes(n_classes), votes((long)n_rows*n_classes, 0), n_votes(n_rows, 0), locks(n_rows/BLOCK+1) {}
+  // rows ascending
+  void add(const std::vector<int> &rows, const std::vector<int> &ids) { // O(rows)
+    for (int begin = 0, end; begin < rows.size(); begin = end) {
+      int block = rows[begin]/BLOCK;
+      for (end = begin; end < rows.size() && rows[end]/BLOCK == block; ++end) {}
+      std::lock_guard<std::mutex> guard(locks[block]);
+      for (int j = begin; j < end; ++j) {
+        ++votes[(long)rows[j]*n_classes+ids[j]];
+        ++n_votes[rows[j]];
+      }
+    }
+  }
+};
+
+void Forest::out_of_bag(int i, const MatrixView &view, const std::vector<int> &position,
+                        OutOfBagVotes &votes) { // O(view.rows+oob*depth)
+  MatrixView bag;
+  std::vector<int> columns;
+  draw_tree(i, view, columns, &bag); // The same rows the tree trained on
+  std::vector<char> in_bag(view.rows(), 0);
+  const std::vector<int> &bag_rows = bag.row_indices();
+  for (int k = 0; k < bag_rows.size(); ++k) in_bag[position[bag_rows[k]]] = 1;
+  std::vector<int> rows, base_rows;
+  for (int k = 0; k < view.rows(); ++k) {
+    if (in_bag[k]) continue;
+    rows.push_back(k);
+    base_rows.push_back(view.row_indices()[k]);
+  }
+  std::vector<int> ids(rows.size());
+  flat_trees[i].classify_batch_ids(view.matrix(), base_rows.data(), base_rows.size(), ids.data());
+  votes.add(rows, ids);
+}
+
+void Forest::out_of_bag_trees(const MatrixView &view, const std::vector<int> &position, OutOfBagVotes &votes) {
+  for (int i = 0; i < trees.size(); ++i) out_of_bag(i, view, position, votes);
+}
+
+/*
+ * Every row is classified by the trees whose bag missed it, so the accuracy
+ * estimates that of the forest on unseen rows at the cost of one training
+ * instead of k of cross validation.
+ * */
+void Forest::score_out_of_bag(const MatrixView &view) { // O(n_trees*view.rows*depth)
+  oob_predictions.clear();
+  oob_percent = -1.0;
+  if (bag_fraction <= 0.0) return;
+  std::vector<int> position(view.matrix().rows(), -1);
+  for (int k = 0; k < view.rows(); ++k) position[view.row_indices()[k]] = k;
+  int n_classes = classes.size();
+  OutOfBagVotes votes(view.rows(), n_classes);
+  out_of_bag_trees(view, position, votes);
+  oob_predictions.assign(view.rows(), -1);
+  int right = 0, scored = 0;
+  int last = view.matrix().columns()-1;
+  for (int k = 0; k < view.rows(); ++k) {
+    if (votes.n_votes[k] == 0) continue;
+    oob_predictions[k] = (int)classes[majority(&votes.votes[(long)k*n_classes], n_classes)];
+    right += oob_predictions[k] == (int)view.at(k, last);
+    ++scored;
+  }
+  if (scored > 0) oob_percent = right*100.0/scored;
+}
+
+// Rows to pass over before the next row drawn with probability fraction, geometrically distributed
+static long skip(double fraction, Random &random) { // O(1)
+  if (fraction >= 1.0) return 0;
+  double u = random.uniform();
+  return (long)(log(u)/log(1.0-fraction));
+}
+
+// The rows one tree draws from a stream, projected on its columns and the class
+struct Sample {
+  std::vector<int> columns;
+  std::vector<double> elements; // One row after another
+  long next; // Row of the stream to draw next
+  Random random; // Stream of the tree
+};
+
+static void project(Matrix &m, int row, const std::vector<int> &columns, std::vector<double> &out) {
+  for (int j = 0; j < columns.size(); ++j) out.push_back(m.at(row, columns[j]));
+  out.push_back(m.at(row, m.columns()-1));
+}
+
+/*
+ * Only the samples are held in memory, each projected on the columns of its
+ * tree, while the stream is read one block at a time. A sample that draws no
+ * row gets the first row of the stream, so that every tree has a root.
+ * */
+void Forest::train(MatrixStream &stream, double fraction, long max_bytes) { // O(passes*rows*columns)
+  assert(fraction > 0.0);
+  int n_columns = stream.columns();
+  int width = std::min(n_features, n_columns-1)+1;
+  double tree_bytes = std::max(1.0, fraction*stream.estimate_rows()*width*sizeof(double));
+  int group = std::max(1L, std::min((long)trees.size(), (long)(max_bytes/tree_bytes)));
+  classes.clear();
+  oob_predictions.clear(); // The samples are not kept to score out of bag
+  oob_percent = -1.0;
+  Matrix block(Matrix::ROW_MAJOR); // Samples take whole rows
+  for (int first = 0; first < trees.size(); first += group) {
+    std::vector<Sample> samples(std::min(group, (int)trees.size()-first));
+    for (int i = 0; i < samples.size(); ++i) {
+      Sample &sample = samples[i];
+      sample.random = Random(seed).split(first+i); // The same columns as draw_tree would give tree first+i
+      sample.columns = draw_columns(n_columns, n_features, sample.random);
+      sample.next = skip(fraction, sample.random);
+    }
+    stream.rewind();
+    std::vector<double> first_row;
+    long offset = 0;
+    while (stream.next(block)) {
+      if (offset == 0) first_row = block[0].to_vector();
+      for (int k = 0; first == 0 && k < block.n_classes(); ++k) { // Every pass sees all classes, the first one collects them
+        double value = block.class_value(k);
+        std::vector<double>::iterator it = std::lower_bound(classes.begin(), classes.end(), value);
+        if (it == classes.end() || *it != value) classes.insert(it, value);
+      }
+      for (int i = 0; i < samples.size(); ++i) {
+        Sample &sample = samples[i];
+        for (; sample.next < offset+block.rows(); sample.next += 1+skip(fraction, sample.random))
+          project(block, sample.next-offset, sample.columns, sample.elements);
+      }
+      offset += block.rows();
+    }
+    assert(offset > 0);
+    assert(classes.size() <= Matrix::MAX_CLASSES);
+    std::vector<Matrix> matrices(samples.size());
+    std::vector<MatrixView> views(samples.size());
+    std::vector<const MatrixView*> pointers(samples.size());
+    std::vector<BinnedMatrix> binned(samples.size());
+    std::vector<BinnedMatrix*> bins(samples.size(), (BinnedMatrix*)NULL);
+    std::vector<std::vector<int> > columns(samples.size());
+    for (int i = 0; i < samples.size(); ++i) {
+      Sample &sample = samples[i];
+      if (sample.elements.empty()) {
+        for (int j = 0; j < sample.columns.size(); ++j) sample.elements.push_back(first_row[sample.columns[j]]);
+        sample.elements.push_back(first_row.back());
+      }
+      int sample_width = sample.columns.size()+1;
+      matrices[i].assign(sample.elements.size()/sample_width, sample_width, sample.elements);
+      views[i] = MatrixView(matrices[i]);
+      pointers[i] = &views[i];
+      columns[i] = range(sample_width-1);
+      if (max_bins == 0) continue;
+      bin(views[i], binned[i]);
+      bins[i] = &binned[i];
+    }
+    train_trees(pointers, bins, columns, first, false);
+    for (int i = 0; i < samples.size(); ++i) trees[first+i].remap(samples[i].columns, matrices[i], classes);
+  }
+  compile();
+}
+
+void Forest::compile() {
+  flat_trees.resize(trees.size());
+  n_columns = 0;
   for (int i = 0; i < trees.size(); ++i) {
-    TreeNode &tree = trees[i];
-    random_shuffle(all_columns.begin(), all_columns.end());
-    std::vector<int> sub_cols = slice(all_columns, 0, n_features); // 训练列数
-    tree.train(m, sub_cols);
+    flat_trees[i].compile(trees[i]);
+    n_columns = std::max(n_columns, flat_trees[i].columns());
   }
 }
 
-int Forest::classify(std::vector<double> &row) {
-  std::vector<double> votes;
+bool Forest::save(std::string filename) { return ModelFile::save(filename, flat_trees, classes); }
+
+// The compiled trees are used in place from the mapped file
+bool Forest::load(std::string filename) { // O(nodes) validation
+  if (!model.open(filename)) return false;
+  n_trees = model.trees();
+  trees.clear(); // Fresh trees in case of retraining, the old ones free their arenas
+  trees.resize(n_trees);
+  flat_trees.resize(n_trees);
+  for (int i = 0; i < n_trees; ++i) flat_trees[i].map(model.nodes(i), model.count(i));
+  classes = model.classes();
+  n_columns = model.columns();
+  oob_predictions.clear();
+  oob_percent = -1.0;
+  return true;
+}
+
+int Forest::classify(const VectorView &row) { // O(n_trees*depth), no allocation
+  int votes[Matrix::MAX_CLASSES];
+  int n_classes = classes.size();
+  std::fill(votes, votes+n_classes, 0);
   for (int i = 0; i < n_trees; ++i) {
-    TreeNode &tree = trees[i];
-    double vote = tree.classify(row);
-    votes.push_back(vote);
+    FlatTree &tree = flat_trees[i];
+    ++votes[tree.classify_id(row)];
+  }
+  return (int)classes[majority(votes, n_classes)];
+}
+
+/*
+ * Rows are scored in blocks: every tree classifies the whole block before the
+ * next tree, so a tree's nodes stay in cache while it walks many rows, and the
+ * votes of the block are counted per class id.
+ * */
+void Forest::classify_batch(Matrix &m, const int *rows, int n, int *out) { // O(n*n_trees*depth)
+  assert(m.columns() >= n_columns);
+  static const int BLOCK = 256;
+  int n_classes = classes.size();
+  std::vector<int> votes(BLOCK*n_classes);
+  std::vector<int> ids(BLOCK);
+  for (int start = 0; start < n; start += BLOCK) {
+    int count = std::min(BLOCK, n-start);
+    std::vector<int> block_rows;
+    if (rows == NULL) block_rows = range(start, start+count);
+    const int *block = (rows != NULL) ? rows+start : block_rows.data();
+    std::fill(votes.begin(), votes.end(), 0);
+    for (int i = 0; i < n_trees; ++i) {
+      flat_trees[i].classify_batch_ids(m, block, count, ids.data());
+      for (int j = 0; j < count; ++j) ++votes[j*n_classes+ids[j]];
+    }
+    for (int j = 0; j < count; ++j) out[start+j] = (int)classes[majority(&votes[j*n_classes], n_classes)];
   }
-  return (int)mode(votes);
 }
@@ -1,17 +1,72 @@
 #ifndef FOREST_H_
 #define FOREST_H_
-#include "cart/tree_node.h" // Classifier, TreeNode, Matrix
+#include <stdint.h> // uint64_t
+#include "cart/binned_matrix.h" // BinnedMatrix, MatrixView
+#include "cart/flat_tree.h" // Classifier, TreeNode, FlatTree, Matrix
+#include "cart/model.h" // ModelFile
+
+struct OutOfBagVotes;
 
 class Forest : public Classifier {
  protected:
   int n_trees;
   int n_features;
+  int max_bins; // Histogram bins for split search, at most BinnedMatrix::MAX_BINS, 0 for exact splits
+  double bag_fraction; // Rows each tree samples, 0 for all rows
+  bool bag_replace; // Sample with replacement (bootstrap) or without (subsample)
   std::vector<TreeNode> trees;
+  std::vector<std::vector<int> > subsets; // Candidate columns of each tree
+  uint64_t seed; // Of the random streams of the trees
+  std::vector<int> oob_predictions; // By row of the last training view, -1 for rows in every bag
+  double oob_percent; // Accuracy of oob_predictions, -1 without bagging
+  std::vector<FlatTree> flat_trees; // trees compiled for classification
+  std::vector<double> classes; // Class values of the training Matrix by dense id
+  int n_columns; // Columns a row needs to be classified, see FlatTree::columns
+  ModelFile model; // Mapping that flat_trees point into after load
+  void set_classes(Matrix &m);
+  void compile();
+  // Draw the candidate columns of trees[i] from view, and with bag its rows when bagging. The draws
+  // depend on the seed and i alone, so a bag is drawn again to find its rows rather than kept.
+  void draw_tree(int i, const MatrixView &view, std::vector<int> &columns, MatrixView *bag);
+  // Bin view into max_bins quantiles per column, see BinnedMatrix::build
+  virtual void bin(const MatrixView &view, BinnedMatrix &binned);
+  // Train trees[first+i] on *views[i], binned as *bins[i] or exact when NULL, with the candidate columns[i].
+  // With bagged, on the bag of *views[i] that the tree draws first and frees when trained.
+  virtual void train_trees(std::vector<const MatrixView*> &views, std::vector<BinnedMatrix*> &bins,
+                           std::vector<std::vector<int> > &columns, int first, bool bagged);
+  // Add the class ids tree i gives the rows of view left out of its bag to votes, by their index in view.
+  // position maps a row of the base matrix to its index in view.
+  void out_of_bag(int i, const MatrixView &view, const std::vector<int> &position, OutOfBagVotes &votes);
+  // out_of_bag of every tree
+  virtual void out_of_bag_trees(const MatrixView &view, const std::vector<int> &position, OutOfBagVotes &votes);
+  void score_out_of_bag(const MatrixView &view);
  public:
   Forest();
   Forest(int n_trees, int n_features);
   void init(int n_trees, int n_features);
+  void set_max_bins(int max_bins);
+  // Train every tree on its own sample of fraction of the rows, as row indices into the
+  // training matrix, or on all rows when fraction is 0
+  void set_bagging(double fraction, bool replace);
+  // Every draw of the forest is a function of the seed, whatever the threads
+  void set_seed(uint64_t seed);
   virtual void train(Matrix &m);
-  virtual int classify(std::vector<double> &row);
+  // Train on some rows of a matrix, e.g. the folds of cross validation, without copying them
+  void train(const MatrixView &view);
+  // Train out of core: every tree draws each row of the stream with probability fraction.
+  // Samples of at most max_bytes are held at once, the trees beyond that sample in more passes.
+  void train(MatrixStream &stream, double fraction, long max_bytes);
+  // Out-of-bag accuracy of the last training with bagging, in percent: the votes of the trees
+  // that did not train on a row, over the rows some tree left out. -1 without bagging.
+  double oob_accuracy() { return oob_percent; }
+  // The class of each row of the last training view by those votes, -1 where no tree left it out
+  const std::vector<int> &get_oob_predictions() { return oob_predictions; }
+  // Write the compiled trees as a model file, or classify with one instead of training
+  bool save(std::string filename);
+  bool load(std::string filename);
+  // Rows with fewer columns cannot be classified
+  int columns() { return n_columns; }
+  virtual int classify(const VectorView &row);
+  virtual void classify_batch(Matrix &m, const int *rows, int n, int *out);
 };
 #endif
@@ -1,88 +1,225 @@
 #include <cassert> // atoi, assert, exit
+#include <cstdlib> // strtoul
 #include <cstdio> // printf
 #include <string> // string
 #include <unistd.h> // getopt, optarg
-#include "cart/matrix.h" // Matrix, load, rows, columns, submatrix, shuffled, merge_rows, operator, append_column, save
-#include "cart/util.h" // range, merge
-#include "random_forest/parallel_forest.h" // Classifier, ParallelForest, train, classify
+#include "cart/matrix.h" // Matrix, MatrixStream, load, rows, columns
+#include "cart/matrix_view.h" // MatrixView, slice, concat, save_columns
+#include "cart/random.h" // Random, split
+#include "cart/writer.h" // BufferedWriter
+#include "random_forest/parallel_forest.h" // Classifier, ParallelForest, draw, train, classify
+#include "random_forest/pthread_pool.h" // pool_start, pool_start_numa, pool_spawn, pool_group_wait, pool_end
 
-int n_threads, n_trees, n_features;
-double test(Classifier *c, Matrix &m, std::vector<int> &classes) {
-  classes.empty();
+int n_threads, n_trees, n_features, n_bins;
+long memory_mb; // Out-of-core training with samples of at most this size when > 0
+double sample_fraction = 0.1; // Rows each tree samples when training out of core
+double bag_fraction; // Rows each tree samples in memory, 0 for all of them
+bool bag_replace = true;
+unsigned long seed; // Of every random draw, the same seed gives the same forests for any number of threads
+bool numa; // Pin the threads to NUMA nodes, each with its own copy of the training data
+double test(Classifier *c, const MatrixView &m) {
   // Analyze the results of the tree against training dataset
   int right = 0;
   int wrong = 0;
+  std::vector<int> predictions(m.rows());
+  c->classify_batch(m.matrix(), m.row_indices().data(), m.rows(), predictions.data());
+  int last = m.matrix().columns()-1;
   for (int i = 0; i < m.rows(); ++i) {
-    std::vector<double> &row = m[i];
-    int actual_class = row[row.size()-1];
-    int predict_class = c->classify(row);
-    classes.push_back(actual_class);
+    int actual_class = m.at(i, last);
+    int predict_class = predictions[i];
     if (predict_class == actual_class) ++right;
     else ++wrong;
   }
   double percent = right*100.0/m.rows();
   return percent;
 }
-double train_and_test(Matrix &train, Matrix &testing) {
-  ParallelForest forest(n_trees, n_features, n_threads);
-  forest.train(train);
-  std::vector<int> classes;
-  Classifier *classifier = &forest;
-  double percent = test(classifier, testing, classes);
-  printf("subtrain set correct: %f%%\n", percent);
+// One fold of cross validation, trained and tested as a task of the pool shared by all folds
+struct Fold {
+  MatrixView training;
+  MatrixView testing;
+  ParallelForest *forest;
+  double percent;
+};
 
-  std::vector<double> class_doubles(classes.begin(), classes.end());
-  testing.append_column(class_doubles);
-  return percent;
+void *fold_thread(void *void_ptr) {
+  Fold *fold = (Fold*)void_ptr;
+  fold->forest->train(fold->training);
+  fold->percent = test(fold->forest, fold->testing);
+  return NULL;
 }
-void folded_train_and_test(Matrix &input_matrix, int n_folds, std::string &test_file, std::string &result_file) { // n_folds = total/test
-  Matrix result;
-  Matrix matrix = input_matrix;//.shuffled();
-  int R = matrix.rows();
+
+/*
+ * The folds are views of matrix, so no fold copies its rows, and they run
+ * concurrently on one pool: the trees and classifying blocks of every fold
+ * share its threads. Fold i draws from stream i of the seed, so the results
+ * do not depend on the scheduling.
+ * */
+void folded_train_and_test(Matrix &matrix, int n_folds, std::string &test_file, std::string &result_file) { // n_folds = total/test
+  MatrixView all(matrix);//.shuffled();
+  MatrixView result(matrix, std::vector<int>());
+  int R = all.rows();
   int N = R/n_folds;
-  std::vector<int> all_columns = range(0, matrix.columns());
-  double total_percent = 0.0;
+  void *pool = numa ? pool_start_numa(NULL, n_threads) : pool_start(NULL, n_threads);
+  void *group = pool_group_create();
+  std::vector<Fold> folds(n_folds);
   for (int i = 0; i < n_folds; ++i) {
-    printf("Training and Testing Fold #%d\n", i);
-
+    Fold &fold = folds[i];
     // Get training subset
-    std::vector<int> training_rows;
     // Begining fold
-    if (i == 0) training_rows = range(N, R);
+    if (i == 0) fold.training = all.slice(N, R);
     // Middle fold
-    else if (i < n_folds-1) training_rows = merge(range(0, i*N), range((i+1)*N, R));
+    else if (i < n_folds-1) fold.training = all.slice(0, i*N).concat(all.slice((i+1)*N, R));
     // Last fold
-    else training_rows = range(0, R-N);
-    //for (auto i: training_rows) printf("t_r=%d,R=%d,N=%d\n", i, R, N);
-    Matrix training = matrix.submatrix(training_rows, all_columns);
-    // Get testing subset
-    std::vector<int> testing_rows = range(i*N, (i+1)*N);
-    // Include extra elements into last fold
-    if (i == n_folds-1) testing_rows = range(i*N, R);
-    Matrix testing = matrix.submatrix(testing_rows, all_columns);
-    // Test
-    total_percent += train_and_test(training, testing);
-    //printf("n_f=%dt_p=%f\n", i, total_percent);
-    // Store results (classID is in testing)
-    result.merge_rows(testing);
+    else fold.training = all.slice(0, R-N);
+    // Get testing subset, and include extra elements into last fold
+    fold.testing = all.slice(i*N, (i == n_folds-1) ? R : (i+1)*N);
+    fold.forest = new ParallelForest(n_trees, n_features, n_threads, pool);
+    fold.forest->set_max_bins(n_bins);
+    fold.forest->set_bagging(bag_fraction, bag_replace);
+    fold.forest->set_numa(numa);
+    fold.forest->set_seed(Random(seed).split(i).next());
+    // Store results (classID is in the last column)
+    result = result.concat(fold.testing);
+  }
+  for (int i = 0; i < n_folds; ++i) pool_spawn(pool, fold_thread, &folds[i], group);
+  pool_group_wait(pool, group);
+  pool_group_destroy(group);
+  double total_percent = 0.0;
+  for (int i = 0; i < n_folds; ++i) {
+    printf("Training and Testing Fold #%d\n", i);
+    printf("subtrain set correct: %f%%\n", folds[i].percent);
+    if (folds[i].forest->oob_accuracy() >= 0.0) printf("out-of-bag correct: %f%%\n", folds[i].forest->oob_accuracy());
+    total_percent += folds[i].percent;
+    delete folds[i].forest;
   }
+  pool_end(pool);
   double percent = total_percent/n_folds;
   printf("Finall correct: %f%%\n", percent);
 
-  std::vector<int> rows = range(result.rows());
   std::vector<int> cols;
-  cols.push_back(result.columns()-1);
-  printf("%lu\t%lu\n", rows.size(), cols.size());
-  printf("%d\t%d\n", result.rows(), result.columns());
-  Matrix sub = result.submatrix(rows, cols);
-  sub.save(result_file.c_str(), "Class");
+  cols.push_back(matrix.columns()-1);
+  printf("%d\t%lu\n", result.rows(), cols.size());
+  printf("%d\t%d\n", result.rows(), matrix.columns()+1);
+  result.save_columns(result_file.c_str(), cols, std::vector<std::string>(1, "Class"));
+}
+
+// Row labels and predicted classes under the id,Class header of folded_train_and_test
+void write_predictions(BufferedWriter &file, Matrix &m, std::vector<int> &predictions, bool header) { // O(rows)
+  const std::vector<std::string> &labels = m.get_column_labels();
+  const std::vector<std::string> &ids = m.get_row_labels();
+  if (header) {
+    if (ids.size() > 0 && labels.size() > 0) {
+      file.write(labels[0]);
+      file.put(',');
+    }
+    file.write("Class\n", 6);
+  }
+  for (int i = 0; i < m.rows(); ++i) {
+    if (ids.size() > 0) {
+      file.write(ids[i]);
+      file.put(',');
+    }
+    file.write_int(predictions[i]);
+    file.put('\n');
+  }
+}
+
+/*
+ * Classify test_file, or train_file when there is none, with the model in
+ * model_file. Without a model, train on all of train_file and save it, so
+ * the next run skips training and loading the training set.
+ * */
+void model_train_and_test(std::string &train_file, std::string &test_file, std::string &model_file, std::string &result_file) {
+  ParallelForest forest(n_trees, n_features, n_threads);
+  forest.set_max_bins(n_bins);
+  forest.set_bagging(bag_fraction, bag_replace);
+  forest.set_seed(seed);
+  forest.set_numa(numa);
+  Matrix m;
+  if (forest.load(model_file)) {
+    printf("Loaded model %s\n", model_file.c_str());
+  } else {
+    m.cache_load(train_file);
+    printf("\n\n%d rows and %d columns\n", m.rows(), m.columns());
+    forest.train(m);
+    if (forest.oob_accuracy() >= 0.0) printf("Out-of-bag correct: %f%%\n", forest.oob_accuracy());
+    if (forest.save(model_file)) printf("Saved model %s\n", model_file.c_str());
+    else fprintf(stderr, "Cannot write model %s\n", model_file.c_str());
+  }
+  bool labeled = test_file.empty(); // The training set has its classes to check against
+  if (!labeled) m = Matrix();
+  if (m.rows() == 0) m.cache_load(labeled ? train_file : test_file);
+  if (m.columns() < forest.columns()) {
+    fprintf(stderr, "Cannot classify %s: %d columns, the model needs %d\n",
+            (labeled ? train_file : test_file).c_str(), m.columns(), forest.columns());
+    return;
+  }
+  std::vector<int> predictions(m.rows());
+  forest.classify_batch(m, NULL, m.rows(), predictions.data());
+  if (labeled) {
+    int right = 0;
+    for (int i = 0; i < m.rows(); ++i) right += predictions[i] == (int)m.at(i, m.columns()-1);
+    printf("Train set correct: %f%%\n", right*100.0/m.rows());
+  }
+  if (result_file.empty()) return;
+  BufferedWriter result;
+  if (!result.open(result_file)) return;
+  write_predictions(result, m, predictions, true);
+  if (!result.close()) fprintf(stderr, "Cannot write %s\n", result_file.c_str());
+}
+
+/*
+ * model_train_and_test for files larger than memory: the forest is trained
+ * on per-tree row samples of a stream, and the rows are classified and
+ * written one block at a time.
+ * */
+void stream_train_and_test(std::string &train_file, std::string &test_file, std::string &model_file, std::string &result_file) {
+  ParallelForest forest(n_trees, n_features, n_threads);
+  forest.set_max_bins(n_bins);
+  forest.set_seed(seed);
+  forest.set_numa(numa);
+  MatrixStream stream;
+  if (forest.load(model_file)) {
+    printf("Loaded model %s\n", model_file.c_str());
+  } else {
+    if (!stream.open(train_file)) {
+      fprintf(stderr, "Cannot read %s\n", train_file.c_str());
+      return;
+    }
+    printf("\n\nabout %ld rows and %d columns\n", stream.estimate_rows(), stream.columns());
+    forest.train(stream, sample_fraction, memory_mb << 20);
+    if (forest.save(model_file)) printf("Saved model %s\n", model_file.c_str());
+    else fprintf(stderr, "Cannot write model %s\n", model_file.c_str());
+  }
+  bool labeled = test_file.empty();
+  if (!stream.open(labeled ? train_file : test_file)) return;
+  if (stream.columns() < forest.columns()) {
+    fprintf(stderr, "Cannot classify %s: %d columns, the model needs %d\n",
+            (labeled ? train_file : test_file).c_str(), stream.columns(), forest.columns());
+    return;
+  }
+  BufferedWriter result;
+  if (!result_file.empty() && !result.open(result_file)) fprintf(stderr, "Cannot write %s\n", result_file.c_str());
+  Matrix block(Matrix::ROW_MAJOR);
+  std::vector<int> predictions;
+  long right = 0, total = 0;
+  while (stream.next(block)) {
+    predictions.resize(block.rows());
+    forest.classify_batch(block, NULL, block.rows(), predictions.data());
+    if (labeled)
+      for (int i = 0; i < block.rows(); ++i) right += predictions[i] == (int)block.at(i, block.columns()-1);
+    if (!result_file.empty()) write_predictions(result, block, predictions, total == 0);
+    total += block.rows();
+  }
+  if (!result_file.empty() && !result.close()) fprintf(stderr, "Cannot write %s\n", result_file.c_str());
+  if (labeled && total > 0) printf("Train set correct: %f%%\n", right*100.0/total);
 }
 
 int main(int argc, char **argv) {
   // Input
   int c;
-  std::string train_file, test_file, result_file;
-  while ((c = getopt(argc, argv, "t:s:r:c:p:n:f:m:")) != -1) {
+  std::string train_file, test_file, result_file, model_file;
+  while ((c = getopt(argc, argv, "t:s:r:c:p:n:f:m:b:M:o:B:S:R:N")) != -1) {
     switch (c) {
       case 't': train_file = optarg; break; // Train file
       case 's': test_file = optarg; break; // Test file
@@ -93,17 +230,35 @@ int main(int argc, char **argv) {
                 assert(n_trees > 0); break;
       case 'f': n_features = atoi(optarg); // The nums of features selected
                 assert(n_features > 0); break;
-      case 'm': break; // The MINIMUM_GAIN
+      case 'm': model_file = optarg; break; // Model file to load, or to save after training
+      case 'b': n_bins = atoi(optarg); // Histogram bins per feature, 0 for exact splits
+                assert(n_bins == 0 || (n_bins > 1 && n_bins <= BinnedMatrix::MAX_BINS)); break;
+      case 'M': memory_mb = atol(optarg); // Train out of core holding at most this many MB of samples
+                assert(memory_mb > 0); break;
+      case 'o': sample_fraction = atof(optarg); // Fraction of the rows each tree samples out of core
+                assert(sample_fraction > 0.0 && sample_fraction <= 1.0); break;
+      case 'B': bag_fraction = atof(optarg); // Bootstrap: each tree draws this fraction of the rows with replacement
+                bag_replace = true;
+                assert(bag_fraction > 0.0); break;
+      case 'S': bag_fraction = atof(optarg); // Subsample: each tree draws this fraction of the rows without replacement
+                bag_replace = false;
+                assert(bag_fraction > 0.0 && bag_fraction <= 1.0); break;
+      case 'R': seed = strtoul(optarg, NULL, 10); break; // Random seed
+      case 'N': numa = true; break; // NUMA placement of the threads and the training data
       default: exit(1);
     }
   }
   if (n_threads <= 0) n_threads = 16;
+  if (!model_file.empty()) {
+    if (memory_mb > 0) stream_train_and_test(train_file, test_file, model_file, result_file);
+    else model_train_and_test(train_file, test_file, model_file, result_file);
+    return 0;
+  }
   Matrix m;
-  m.load(train_file);
+  m.cache_load(train_file);
   printf("\n\n%d rows and %d columns\n", m.rows(), m.columns());
 
   // Model build and Output
-  //train_and_test(m, m);
   folded_train_and_test(m, 2, test_file, result_file);
 
   return 0;
@@ -1,52 +1,247 @@
+#include <algorithm> // max, min
+#include <cassert> // assert
 #include <cstdio>
-#include "cart/util.h" // range, slice
+#include "cart/util.h" // range
 #include "random_forest/parallel_forest.h"
-#include "random_forest/pthread_pool.h" // pool_start, pool_enqueue, pool_wait, pool_end
+#include "random_forest/pthread_pool.h" // pool_start, pool_start_numa, pool_spawn, pool_spawn_on, pool_group_create, pool_group_wait, pool_end
 
-ParallelForest::ParallelForest() {
+static const int CLASSIFY_ROWS = 4096; // Rows below which a classifying task is not worth spawning
+
+ParallelForest::ParallelForest() : pool(NULL), own_pool(true), numa(false) {
   init(2, 10);
   n_threads = 4;
 }
 
-ParallelForest::ParallelForest(int n_trees, int n_features, int n_threads) {
+ParallelForest::ParallelForest(int n_trees, int n_features, int n_threads) : pool(NULL), own_pool(true), numa(false) {
+  this->n_threads = n_threads;
+  init(n_trees, n_features);
+}
+
+ParallelForest::ParallelForest(int n_trees, int n_features, int n_threads, void *pool)
+    : pool(pool), own_pool(false), numa(false) {
   this->n_threads = n_threads;
   init(n_trees, n_features);
 }
 
-struct Task {
-  Matrix *matrix;
+ParallelForest::~ParallelForest() {
+  if (own_pool && pool != NULL) pool_end(pool);
+}
+
+void ParallelForest::set_numa(bool numa) {
+  assert(pool == NULL || !own_pool);
+  this->numa = numa;
+}
+
+void *ParallelForest::get_pool() {
+  if (pool == NULL) pool = numa ? pool_start_numa(NULL, n_threads) : pool_start(NULL, n_threads);
+  return pool;
+}
+
+// Lets the trees spawn their own subtrees and column chunks on the same pool, into one wait group
+class PoolSpawner : public TaskSpawner {
+ private:
+  void *pool;
+  void *group;
+  int n_threads;
+ public:
+  PoolSpawner(void *pool, void *group, int n_threads) : pool(pool), group(group), n_threads(n_threads) {}
+  virtual void spawn(void *(*fn)(void *), void *arg) { pool_spawn(pool, fn, arg, group); }
+  virtual int threads() { return n_threads; }
+  virtual void wait() { pool_group_wait(pool, group); }
+};
+
+struct TreeTask {
+  ParallelForest *forest;
+  int index; // Of the tree in the forest, to draw its bag from view when bagged
+  bool bagged;
+  const MatrixView *view;
+  Matrix *replica; // Copy of the matrix of view to train on instead, NULL for none
   TreeNode *tree;
   std::vector<int> *subset;
+  BinnedMatrix *bins;
+  TaskSpawner *spawner;
 };
 
-void *training_thread(void *void_ptr) {
-  Task *task = (Task*)void_ptr;
-  task->tree->train(*task->matrix, *task->subset);
+void *tree_thread(void *void_ptr) {
+  TreeTask *task = (TreeTask*)void_ptr;
+  const MatrixView *rows = task->view;
+  MatrixView bag; // Only while the tree copies its rows, see TreeNode::train
+  if (task->bagged) {
+    std::vector<int> columns;
+    task->forest->draw_tree(task->index, *task->view, columns, &bag);
+    rows = &bag;
+  }
+  if (task->replica != NULL) {
+    MatrixView view(*task->replica, rows->row_indices()); // The same rows of the copy
+    task->tree->train(view, *task->subset, task->bins, task->spawner);
+  } else {
+    task->tree->train(*rows, *task->subset, task->bins, task->spawner);
+  }
   return NULL;
 }
 
-void ParallelForest::train(Matrix &m) {
-  //printf("parallel forest training with %lu trees and %d threads\n", trees.size(), n_threads);
-  // Create thread pool
-  void *pool = pool_start(&training_thread, n_threads);
-  // Run through threads
-  std::vector<std::vector<int> > all_subsets(trees.size());
-  std::vector<int> all_columns = range(m.columns()-1);
-  for (int i = 0; i < trees.size(); ++i) {
-    TreeNode &tree = trees[i];
-    random_shuffle(all_columns.begin(), all_columns.end());
-    all_subsets[i] = slice(all_columns, 0, n_features);
+// The training data of one NUMA node, copied by a worker of the node so its pages are there
+struct Replica {
+  Matrix *source;
+  BinnedMatrix *source_bins;
+  Matrix matrix;
+  BinnedMatrix bins;
+};
 
+void *replica_thread(void *void_ptr) {
+  Replica *replica = (Replica*)void_ptr;
+  replica->matrix = *replica->source;
+  if (replica->source_bins != NULL) replica->bins = *replica->source_bins;
+  return NULL;
+}
+
+/*
+ * Copies of the matrix and bins shared by every tree for the nodes of pool
+ * but node 0, whose trees train on the originals, replicas[k-1] for node k.
+ * None with one node or trees on different matrices.
+ * */
+static void replicate(void *pool, std::vector<const MatrixView*> &views, std::vector<BinnedMatrix*> &bins,
+                      std::vector<Replica> &replicas) { // O(nodes*rows*columns)
+  int nodes = pool_nodes(pool);
+  if (nodes <= 1) return;
+  for (int i = 1; i < views.size(); ++i)
+    if (&views[i]->matrix() != &views[0]->matrix() || bins[i] != bins[0]) return;
+  replicas.resize(nodes-1);
+  void *group = pool_group_create();
+  for (int k = 1; k < nodes; ++k) {
+    replicas[k-1].source = &views[0]->matrix();
+    replicas[k-1].source_bins = bins[0];
+    pool_spawn_on(pool, k, replica_thread, &replicas[k-1], group);
+  }
+  pool_group_wait(pool, group);
+  pool_group_destroy(group);
+}
+
+void ParallelForest::train_trees(std::vector<const MatrixView*> &views, std::vector<BinnedMatrix*> &bins,
+                                 std::vector<std::vector<int> > &columns, int first, bool bagged) {
+  //printf("parallel forest training with %lu trees and %d threads\n", views.size(), n_threads);
+  void *pool = get_pool();
+  void *group = pool_group_create();
+  PoolSpawner spawner(pool, group, n_threads);
+  std::vector<Replica> replicas;
+  if (numa) replicate(pool, views, bins, replicas);
+  // Run through threads
+  std::vector<TreeTask> tree_tasks(views.size());
+  for (int i = 0; i < views.size(); ++i) {
     // Create task
-    Task *task = new Task;
-    task->matrix = &m;
-    task->tree = &tree;
-    task->subset = &all_subsets[i];
+    TreeTask &tree_task = tree_tasks[i];
+    tree_task.forest = this;
+    tree_task.index = first+i;
+    tree_task.bagged = bagged;
+    tree_task.view = views[i];
+    tree_task.replica = NULL;
+    tree_task.tree = &trees[first+i];
+    tree_task.subset = &columns[i];
+    tree_task.bins = bins[i];
+    tree_task.spawner = &spawner;
+
+    if (replicas.empty()) {
+      spawner.spawn(tree_thread, &tree_task);
+    } else { // Trees round robin over the nodes, each on the copy of its node
+      int node = i % (replicas.size()+1);
+      if (node > 0) {
+        Replica &replica = replicas[node-1];
+        tree_task.replica = &replica.matrix;
+        if (tree_task.bins != NULL) tree_task.bins = &replica.bins;
+      }
+      pool_spawn_on(pool, node, tree_thread, &tree_task, group);
+    }
+  }
+  // Join on all, including the subtrees the trees spawned
+  pool_group_wait(pool, group);
+  pool_group_destroy(group);
+}
 
-    pool_enqueue(pool, task, true);
+// The cuts of the columns and the codes of the rows are split over the pool
+void ParallelForest::bin(const MatrixView &view, BinnedMatrix &binned) {
+  void *pool = get_pool();
+  void *group = pool_group_create();
+  PoolSpawner spawner(pool, group, n_threads);
+  binned.build(view, max_bins, &spawner);
+  pool_group_destroy(group);
+}
+
+// The out-of-bag votes of one tree
+struct OutOfBagTask {
+  ParallelForest *forest;
+  int tree;
+  const MatrixView *view;
+  const std::vector<int> *position;
+  OutOfBagVotes *votes;
+};
+
+void *out_of_bag_thread(void *void_ptr) {
+  OutOfBagTask *task = (OutOfBagTask*)void_ptr;
+  task->forest->out_of_bag(task->tree, *task->view, *task->position, *task->votes);
+  return NULL;
+}
+
+void ParallelForest::out_of_bag_trees(const MatrixView &view, const std::vector<int> &position, OutOfBagVotes &votes) {
+  void *pool = get_pool();
+  void *group = pool_group_create();
+  std::vector<OutOfBagTask> tasks(trees.size());
+  for (int i = 0; i < tasks.size(); ++i) {
+    OutOfBagTask &task = tasks[i];
+    task.forest = this;
+    task.tree = i;
+    task.view = &view;
+    task.position = &position;
+    task.votes = &votes;
+    pool_spawn(pool, out_of_bag_thread, &task, group);
+  }
+  pool_group_wait(pool, group);
+  pool_group_destroy(group);
+}
+
+// Rows [start, start+count) of a batch
+struct ClassifyTask {
+  ParallelForest *forest;
+  Matrix *m;
+  const int *rows;
+  int start;
+  int count;
+  int *out;
+};
+
+void *classify_thread(void *void_ptr) {
+  ClassifyTask *task = (ClassifyTask*)void_ptr;
+  std::vector<int> block_rows;
+  if (task->rows == NULL) block_rows = range(task->start, task->start+task->count);
+  const int *rows = (task->rows != NULL) ? task->rows+task->start : block_rows.data();
+  task->forest->Forest::classify_batch(*task->m, rows, task->count, task->out+task->start);
+  return NULL;
+}
+
+/*
+ * Every task writes its own slice of out, so the tasks share nothing but the
+ * read-only trees and matrix. A few tasks per thread leave room for stealing
+ * when some rows take deeper paths than others.
+ * */
+void ParallelForest::classify_batch(Matrix &m, const int *rows, int n, int *out) { // O(n*n_trees*depth/threads)
+  assert(m.columns() >= n_columns);
+  if (n_threads <= 1 || n < 2*CLASSIFY_ROWS) {
+    Forest::classify_batch(m, rows, n, out);
+    return;
+  }
+  int per_task = std::max(CLASSIFY_ROWS, (n+4*n_threads-1)/(4*n_threads));
+  void *pool = get_pool();
+  void *group = pool_group_create();
+  std::vector<ClassifyTask> tasks((n+per_task-1)/per_task);
+  for (int i = 0; i < tasks.size(); ++i) {
+    ClassifyTask &task = tasks[i];
+    task.forest = this;
+    task.m = &m;
+    task.rows = rows;
+    task.start = i*per_task;
+    task.count = std::min(per_task, n-task.start);
+    task.out = out;
+    pool_spawn(pool, classify_thread, &task, group);
   }
-  // Join on all
-  pool_wait(pool);
-  // Free resources
-  pool_end(pool);
+  pool_group_wait(pool, group);
+  pool_group_destroy(group);
 }
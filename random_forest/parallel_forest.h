@@ -1,13 +1,35 @@
 #ifndef PARALLEL_FOREST_H_
 #define PARALLEL_FOREST_H_
-#include "random_forest/forest.h" // Forest, Matrix, classify
+#include "random_forest/forest.h" // Forest, Matrix, classify, classify_batch
 
 class ParallelForest : public Forest {
+ private:
+  void *pool; // Started on first use and kept for training and classifying, NULL before
+  bool own_pool; // pool was started by this forest, rather than shared with it
+  bool numa; // Pin the workers of pool to NUMA nodes and replicate the training data on each
+  ParallelForest(const ParallelForest&);
+  ParallelForest &operator=(const ParallelForest&);
+  friend void *tree_thread(void *void_ptr);
+  friend void *out_of_bag_thread(void *void_ptr);
  protected:
   int n_threads;
+  void *get_pool();
+  virtual void train_trees(std::vector<const MatrixView*> &views, std::vector<BinnedMatrix*> &bins,
+                           std::vector<std::vector<int> > &columns, int first, bool bagged);
+  virtual void bin(const MatrixView &view, BinnedMatrix &binned);
+  virtual void out_of_bag_trees(const MatrixView &view, const std::vector<int> &position, OutOfBagVotes &votes);
  public:
   ParallelForest();
   ParallelForest(int n_trees, int n_features, int n_threads);
-  virtual void train(Matrix &m);
+  // Train and classify on a pool of n_threads threads started by the caller, e.g. one
+  // shared by forests trained concurrently. The pool must outlive the forest.
+  ParallelForest(int n_trees, int n_features, int n_threads, void *pool);
+  ~ParallelForest();
+  // Before the pool starts: pin its workers to the NUMA nodes, give every node its own copy
+  // of the training matrix and bins, and train each tree on a node from that copy.
+  // A shared pool is pinned by whoever starts it, see pool_start_numa.
+  void set_numa(bool numa);
+  // Forest::classify_batch on blocks of the rows across the pool
+  virtual void classify_batch(Matrix &m, const int *rows, int n, int *out);
 };
 #endif
@@ -1,148 +1,410 @@
+#include <algorithm> // min, max, sort
+#include <atomic> // atomic
 #include <cstdio>
-#include <cstdlib> // free, malloc
-#include <pthread.h>
+#include <cstdlib> // free, strtol
+#include <dirent.h> // opendir, readdir
+#include <pthread.h> // pthread_attr_setaffinity_np
+#include <sched.h> // cpu_set_t, CPU_SET, CPU_AND, sched_getaffinity
+#include <vector>
 #include "pthread_pool.h"
 
-// A definition of a task in thread pool
-struct pool_queue {
+// Tasks not completed yet
+struct pool_group {
+  std::atomic<int> pending;
+};
+
+// A definition of a task in thread pool, fn NULL for the function of the pool
+struct pool_task {
+  void *(*fn)(void *);
   void *arg;
   bool free;
-  struct pool_queue *next;
+  struct pool_group *group;
+  int node; // Only workers of this node run it, -1 for any
+};
+
+/**
+ * \brief The deque of one worker, a ring buffer of tasks[top..bottom)
+ *
+ * \param mtx           Taken by the owner at the bottom and by thieves at the top, rarely by both
+ * \param tasks         Array of capacity tasks, a power of two
+ * \param top           The next task to steal
+ * \param bottom        Where the owner pushes its next task
+ * \param p             The pool of the worker
+ * \param index         The worker, for the thread to find its deque
+ * \param node          The NUMA node the worker runs on, 0 when unpinned
+ */
+struct pool_deque {
+  pthread_mutex_t mtx;
+  struct pool_task *tasks;
+  unsigned int capacity;
+  unsigned int top;
+  unsigned int bottom;
+  struct pool *p;
+  int index;
+  int node;
 };
 
 /**
  * \brief The threadpool struct
  *
  * \param shutdown      Flag indicating if the pool is shutting down
+ * \param started       Set once the threads are created, workers wait for it before reading nthreads
  * \param fn            The function of task
- * \param remaining     Number of pending threads
- * \param nthreads      Number of threads
- * \param q             Array containing the task queue
- * \param end           The next task in the queues
- * \param q_mtx         A mutex for internal work
- * \param q_cnd         Condition variable to notify worker threads
+ * \param all           Every task not completed yet, for pool_wait
+ * \param queued        Number of tasks in the deques
+ * \param pinned        Number of the queued tasks that only the workers of one node run
+ * \param node_pinned   Array of the pinned tasks of every node
+ * \param sleepers      Number of threads waiting on q_cnd for a task
+ * \param next          The deque of the next task enqueued from outside the pool
+ * \param nthreads      Number of deques, the threads created or 1 when none could be
+ * \param nstarted      Number of threads created
+ * \param nnodes        Number of NUMA nodes the workers are pinned to, worker i to node i%nnodes
+ * \param deques        Array of the deques of the workers
+ * \param q_mtx         A mutex for sleeping and waking only, the deques have their own
+ * \param q_cnd         Condition variable to notify threads of a task or a completed group
  * \param threads       Array containing worker threads ID
  */
 struct pool {
-  bool shutdown;
+  std::atomic<bool> shutdown;
+  bool started;
   void *(*fn)(void *);
-  unsigned int remaining;
+  struct pool_group all;
+  std::atomic<int> queued;
+  std::atomic<int> pinned;
+  std::atomic<int> *node_pinned;
+  std::atomic<int> sleepers;
+  std::atomic<unsigned int> next;
   unsigned int nthreads;
-  struct pool_queue *q;
-  struct pool_queue *end;
+  unsigned int nstarted;
+  unsigned int nnodes;
+  struct pool_deque *deques;
   pthread_mutex_t q_mtx;
   pthread_cond_t q_cnd;
-  pthread_t threads[1];
+  pthread_t *threads;
 };
 
-// Each thread in the thread pool runs in the function.
-// The declaration static should only be used to make the function valid only
-// within this file.
-static void *thread(void *arg) {
-  struct pool_queue *q;
-  struct pool *p = (struct pool *) arg;
+// The worker running on this thread, if any
+static __thread struct pool *current_pool = NULL;
+static __thread int current_worker = -1;
 
-  while (!p->shutdown) {
-    // Lock must be taken to wait on conditional variable
-    pthread_mutex_lock(&p->q_mtx);
+static void push(struct pool_deque *d, const struct pool_task &task) { // O(1) amortized
+  pthread_mutex_lock(&d->mtx);
+  if (d->bottom-d->top == d->capacity) { // Full, double it keeping the order from top
+    struct pool_task *tasks = new pool_task[2*d->capacity];
+    for (unsigned int i = 0; i < d->capacity; ++i) tasks[i] = d->tasks[(d->top+i) & (d->capacity-1)];
+    delete[] d->tasks;
+    d->tasks = tasks;
+    d->top = 0;
+    d->bottom = d->capacity;
+    d->capacity *= 2;
+  }
+  d->tasks[d->bottom++ & (d->capacity-1)] = task;
+  pthread_mutex_unlock(&d->mtx);
+}
+
+// The newest task, which the owner spawned last and is likely still in its cache
+static bool pop(struct pool_deque *d, struct pool_task *task) { // O(1)
+  pthread_mutex_lock(&d->mtx);
+  bool found = d->top != d->bottom;
+  if (found) *task = d->tasks[--d->bottom & (d->capacity-1)];
+  pthread_mutex_unlock(&d->mtx);
+  return found;
+}
+
+// The oldest task, usually the largest piece of work left, unless it is pinned to another node than node
+static bool steal(struct pool_deque *d, int node, struct pool_task *task) { // O(1)
+  pthread_mutex_lock(&d->mtx);
+  bool found = d->top != d->bottom;
+  if (found) {
+    int pinned = d->tasks[d->top & (d->capacity-1)].node;
+    found = pinned < 0 || pinned == node;
+  }
+  if (found) *task = d->tasks[d->top++ & (d->capacity-1)];
+  pthread_mutex_unlock(&d->mtx);
+  return found;
+}
+
+/*
+ * The queued tasks worker self may run, -1 outside the pool for none of the
+ * pinned ones. Read in the opposite order of taken's updates, so a task being
+ * taken can only make it too large, never too small to sleep on.
+ * */
+static int available(struct pool *p, int self) {
+  int queued = p->queued;
+  int others = p->pinned;
+  if (self >= 0) others -= p->node_pinned[p->deques[self].node];
+  return queued-others;
+}
 
-    // Use while in order to re-check the conditions in the wake
-    while (!p->shutdown && p->q == NULL)
-      // The service queue is empty, and the thread pool is not blocked when it is blocked here
-      pthread_cond_wait(&p->q_cnd, &p->q_mtx);
+static void taken(struct pool *p, const struct pool_task &task) {
+  if (task.node >= 0) {
+    --p->pinned;
+    --p->node_pinned[task.node];
+  }
+  --p->queued;
+}
 
-    // Off processing
-    if (p->shutdown) {
-      pthread_mutex_unlock(&p->q_mtx);
-      return NULL;
+/*
+ * Pop from the deque of worker self, or steal from the others: first from the
+ * workers on the node of self, whose tasks read the memory of that node, then
+ * from any but their pinned tasks. Self is -1 outside the pool.
+ * */
+static bool find_task(struct pool *p, int self, struct pool_task *task) { // O(threads)
+  if (available(p, self) <= 0) return false;
+  if (self >= 0 && pop(&p->deques[self], task)) { // Pinned to the node of self, if at all
+    taken(p, *task);
+    return true;
+  }
+  unsigned int start = (self >= 0) ? self+1 : p->next.load();
+  int node = (self >= 0) ? p->deques[self].node : -1;
+  bool local = self >= 0 && p->nnodes > 1;
+  for (int pass = local ? 0 : 1; pass < 2; ++pass) {
+    for (unsigned int i = 0; i < p->nthreads; ++i) {
+      int victim = (start+i) % p->nthreads;
+      if (victim == self || (pass == 0 && p->deques[victim].node != node)) continue;
+      if (steal(&p->deques[victim], node, task)) {
+        taken(p, *task);
+        return true;
+      }
     }
+  }
+  return false;
+}
 
-    // Update q and end
-    q = p->q;
-    p->q = q->next;
-    p->end = (q == p->end ? NULL : p->end);
-    // Unlock
-    pthread_mutex_unlock(&p->q_mtx);
+static void finish(struct pool *p, struct pool_group *g) {
+  if (--g->pending > 0) return;
+  // Wake the threads waiting for the group
+  pthread_mutex_lock(&p->q_mtx);
+  pthread_cond_broadcast(&p->q_cnd);
+  pthread_mutex_unlock(&p->q_mtx);
+}
+
+static void run(struct pool *p, const struct pool_task &task) {
+  (task.fn != NULL ? task.fn : p->fn)(task.arg);
+  if (task.free) free(task.arg);
+  if (task.group != NULL) finish(p, task.group);
+  finish(p, &p->all);
+}
+
+/*
+ * Sleep until a task self may run is queued, the pool shuts down or group
+ * completes. Sleepers is counted before queued is read, and submit counts
+ * queued before reading sleepers, so a task queued meanwhile either stops the
+ * sleep or signals it.
+ * */
+static void idle(struct pool *p, int self, struct pool_group *group) {
+  pthread_mutex_lock(&p->q_mtx);
+  ++p->sleepers;
+  while (!p->shutdown && available(p, self) <= 0 && (group == NULL || group->pending > 0))
+    pthread_cond_wait(&p->q_cnd, &p->q_mtx);
+  --p->sleepers;
+  pthread_mutex_unlock(&p->q_mtx);
+}
 
-    // Start running the task
-    p->fn(q->arg);
+// Each thread in the thread pool runs in the function.
+// The declaration static should only be used to make the function valid only
+// within this file.
+static void *thread(void *arg) {
+  struct pool_deque *d = (struct pool_deque *) arg;
+  struct pool *p = d->p;
+  struct pool_task task;
+  current_pool = p;
+  current_worker = d->index;
+  pthread_mutex_lock(&p->q_mtx);
+  while (!p->started) pthread_cond_wait(&p->q_cnd, &p->q_mtx);
+  pthread_mutex_unlock(&p->q_mtx);
 
-    if (q->free) free(q->arg);
-    free(q);
-    q = NULL;
+  while (!p->shutdown) {
+    if (find_task(p, d->index, &task)) run(p, task);
+    else idle(p, d->index, NULL);
+  }
+
+  return NULL;
+}
 
+// Node is -1 for any node, else the task is pinned to it
+static void submit(struct pool *p, struct pool_task task, int node) {
+  if (task.group != NULL) ++task.group->pending;
+  ++p->all.pending;
+  // Tasks spawned by a worker stay with it until stolen, others are spread over the workers of node
+  int self = (current_pool == p) ? current_worker : -1;
+  node = (node >= 0 && p->nnodes > 1) ? node % p->nnodes : -1; // With one node, anyone may run it
+  if (self < 0 || (node >= 0 && p->deques[self].node != node)) {
+    if (node < 0) self = p->next++ % p->nthreads;
+    else self = node + p->nnodes*(p->next++ % ((p->nthreads-node+p->nnodes-1)/p->nnodes));
+  }
+  task.node = node;
+  if (node >= 0) { // Counted before it can be taken, see available
+    ++p->node_pinned[node];
+    ++p->pinned;
+  }
+  push(&p->deques[self], task);
+  ++p->queued;
+  if (p->sleepers > 0) {
     pthread_mutex_lock(&p->q_mtx);
-    // The thread will end and update the number of running threads
-    --p->remaining;
-    pthread_cond_broadcast(&p->q_cnd);
+    if (node >= 0) pthread_cond_broadcast(&p->q_cnd); // The one signalled might be on another node
+    else pthread_cond_signal(&p->q_cnd);
     pthread_mutex_unlock(&p->q_mtx);
   }
+}
 
-  return NULL;
+// The CPUs this process may run on of every NUMA node with any, from /sys, or none when it is not there
+static std::vector<cpu_set_t> numa_nodes() {
+  std::vector<cpu_set_t> nodes;
+  cpu_set_t allowed; // E.g. narrowed by taskset or a cgroup
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) return nodes;
+  DIR *dir = opendir("/sys/devices/system/node");
+  if (dir == NULL) return nodes;
+  std::vector<int> ids;
+  struct dirent *entry;
+  int id;
+  while ((entry = readdir(dir)) != NULL)
+    if (sscanf(entry->d_name, "node%d", &id) == 1) ids.push_back(id);
+  closedir(dir);
+  std::sort(ids.begin(), ids.end());
+  for (unsigned int k = 0; k < ids.size(); ++k) {
+    char path[64], list[4096];
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", ids[k]);
+    FILE *file = fopen(path, "r");
+    if (file == NULL) continue;
+    bool read = fgets(list, sizeof(list), file) != NULL;
+    fclose(file);
+    if (!read) continue;
+    // A cpulist is like 0-3,8-11
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    char *s = list;
+    while (*s >= '0' && *s <= '9') {
+      long first = strtol(s, &s, 10), last = first;
+      if (*s == '-') last = strtol(s+1, &s, 10);
+      for (long cpu = first; cpu <= last && cpu < CPU_SETSIZE; ++cpu) CPU_SET(cpu, &cpus);
+      if (*s == ',') ++s;
+    }
+    CPU_AND(&cpus, &cpus, &allowed);
+    if (CPU_COUNT(&cpus) > 0) nodes.push_back(cpus); // Nodes of memory only, or of CPUs we may not use, are left out
+  }
+  return nodes;
 }
 
-void *pool_start(void *(*thread_func)(void *), unsigned int threads) {
-  // Request memory to create a thread pool object and an array of threads
-  struct pool *p = (struct pool*) malloc(sizeof(struct pool) + (threads-1) * sizeof(pthread_t));
-  int i;
+// nodes NULL or empty for unpinned workers
+static void *start(void *(*thread_func)(void *), unsigned int threads, const std::vector<cpu_set_t> *nodes) {
+  struct pool *p = new pool;
+  unsigned int i;
 
   // Initialize
+  threads = std::max(threads, 1u); // At least one deque, which tasks queue on
   p->nthreads = threads;
+  p->nnodes = (nodes != NULL && nodes->size() > 0) ? std::min((unsigned int)nodes->size(), threads) : 1;
   p->fn = thread_func;
-  p->shutdown = 0;
-  p->remaining = 0;
-  p->q = NULL;
-  p->end = NULL;
+  p->shutdown = false;
+  p->started = false;
+  p->all.pending = 0;
+  p->queued = 0;
+  p->pinned = 0;
+  p->node_pinned = new std::atomic<int>[p->nnodes];
+  for (i = 0; i < p->nnodes; ++i) p->node_pinned[i] = 0;
+  p->sleepers = 0;
+  p->next = 0;
+  p->deques = new pool_deque[threads];
+  p->threads = new pthread_t[threads];
+  for (i = 0; i < threads; ++i) {
+    struct pool_deque *d = &p->deques[i];
+    pthread_mutex_init(&d->mtx, NULL);
+    d->capacity = 64;
+    d->tasks = new pool_task[d->capacity];
+    d->top = d->bottom = 0;
+    d->p = p;
+    d->index = i;
+    d->node = i % p->nnodes;
+  }
   // Initialize mutex and conditional variable first
   pthread_mutex_init(&p->q_mtx, NULL);
   pthread_cond_init(&p->q_cnd, NULL);
 
-  // Creates the specified number of threads to run
-  for (i = 0; i < threads; ++i) pthread_create(&p->threads[i], NULL, thread, p);
+  // Creates the specified number of threads to run, or as many as the system allows
+  unsigned int created = 0;
+  for (i = 0; i < threads; ++i) {
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    if (nodes != NULL && nodes->size() > 0) // Started on its node, so its stack is there too
+      pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), &(*nodes)[p->deques[i].node]);
+    bool ok = pthread_create(&p->threads[i], &attr, thread, &p->deques[i]) == 0;
+    if (!ok && nodes != NULL && nodes->size() > 0) ok = pthread_create(&p->threads[i], NULL, thread, &p->deques[i]) == 0;
+    pthread_attr_destroy(&attr);
+    if (!ok) break;
+    ++created;
+  }
+  // Only the deques of created threads take tasks, so none waits for a worker that does not exist. Without
+  // any, tasks queue on one deque and run in pool_group_wait.
+  if (created < threads) fprintf(stderr, "pool_start: created %u of %u threads\n", created, threads);
+  pthread_mutex_lock(&p->q_mtx);
+  p->nstarted = created;
+  p->nthreads = std::max(created, 1u);
+  p->nnodes = std::min(p->nnodes, p->nthreads);
+  p->started = true;
+  pthread_cond_broadcast(&p->q_cnd);
+  pthread_mutex_unlock(&p->q_mtx);
+  for (i = p->nthreads; i < threads; ++i) { // Deques without a thread
+    delete[] p->deques[i].tasks;
+    pthread_mutex_destroy(&p->deques[i].mtx);
+  }
 
   return p;
 }
 
+void *pool_start(void *(*thread_func)(void *), unsigned int threads) { return start(thread_func, threads, NULL); }
+
+void *pool_start_numa(void *(*thread_func)(void *), unsigned int threads) {
+  std::vector<cpu_set_t> nodes = numa_nodes();
+  return start(thread_func, threads, &nodes);
+}
+
+int pool_nodes(void *pool) { return ((struct pool *) pool)->nnodes; }
+
 void pool_enqueue(void *pool, void *arg, bool free) {
-  struct pool *p = (struct pool *) pool;
-  struct pool_queue *q = (struct pool_queue *) malloc(sizeof(struct pool_queue));
-  q->arg = arg;
-  q->next = NULL;
-  q->free = free;
+  struct pool_task task = {NULL, arg, free, NULL, -1};
+  submit((struct pool *) pool, task, -1);
+}
 
-  // Mutex lock ownership must be acquired first
-  pthread_mutex_lock(&p->q_mtx);
+void *pool_group_create() {
+  struct pool_group *g = new pool_group;
+  g->pending = 0;
+  return g;
+}
 
-  // Calculate the location where the next task can be stored
-  if (p->end != NULL) p->end->next = q;
-  if (p->q == NULL) p->q = q;
-  p->end = q;
-  // Update remaining
-  ++p->remaining;
+void pool_group_destroy(void *group) { delete (struct pool_group *) group; }
 
-  // A signal is issued indicating that a task has been added
-  pthread_cond_signal(&p->q_cnd);
+void pool_spawn(void *pool, void *(*fn)(void *), void *arg, void *group) {
+  struct pool_task task = {fn, arg, false, (struct pool_group *) group, -1};
+  submit((struct pool *) pool, task, -1);
+}
 
-  // Release the mutex resource
-  pthread_mutex_unlock(&p->q_mtx);
+void pool_spawn_on(void *pool, int node, void *(*fn)(void *), void *arg, void *group) {
+  struct pool_task task = {fn, arg, false, (struct pool_group *) group, -1};
+  submit((struct pool *) pool, task, node);
 }
 
-void pool_wait(void *pool) {
+void pool_group_wait(void *pool, void *group) {
   struct pool *p = (struct pool *) pool;
+  struct pool_group *g = (group != NULL) ? (struct pool_group *) group : &p->all;
+  int self = (current_pool == p) ? current_worker : -1;
+  struct pool_task task;
 
-  pthread_mutex_lock(&p->q_mtx);
-  // The threads is remaining, and the thread pool is blocked when it is not closed here
-  while (!p->shutdown && p->remaining)
-    pthread_cond_wait(&p->q_cnd, &p->q_mtx);
-  pthread_mutex_unlock(&p->q_mtx);
+  // Help instead of blocking, so waiting inside a task does not take a thread away from the pool
+  while (!p->shutdown && g->pending > 0) {
+    if (find_task(p, self, &task)) run(p, task);
+    else idle(p, self, g);
+  }
 }
 
+void pool_wait(void *pool) { pool_group_wait(pool, NULL); }
+
 void pool_end(void *pool) {
   struct pool *p = (struct pool *) pool;
-  struct pool_queue *q;
-  int i;
+  struct pool_task task;
+  unsigned int i;
 
-  p->shutdown = 1;
+  p->shutdown = true;
 
   // Obtain a mutex resource
   pthread_mutex_lock(&p->q_mtx);
@@ -151,16 +413,20 @@ void pool_end(void *pool) {
   pthread_mutex_unlock(&p->q_mtx);
 
   // Join all worker thread
-  for (i = 0; i < p->nthreads; ++i) pthread_join(p->threads[i], NULL);
+  for (i = 0; i < p->nstarted; ++i) pthread_join(p->threads[i], NULL);
 
-  // Release thread,task queue,mutex,condition variable,the thread pool occupies the memory resource
-  while (p->q != NULL) {
-    q = p->q;
-    p->q = q->next;
-
-    if (q->free) free(q->arg);
-    free(q);
+  // Release the tasks left, the deques, mutex, condition variable and the pool itself
+  for (i = 0; i < p->nthreads; ++i) {
+    struct pool_deque *d = &p->deques[i];
+    while (pop(d, &task))
+      if (task.free) free(task.arg);
+    delete[] d->tasks;
+    pthread_mutex_destroy(&d->mtx);
   }
-
-  free(p);
+  pthread_mutex_destroy(&p->q_mtx);
+  pthread_cond_destroy(&p->q_cnd);
+  delete[] p->deques;
+  delete[] p->threads;
+  delete[] p->node_pinned;
+  delete p;
 }
@@ -1,22 +1,43 @@
 /** \file
  * This file provides prototypes for an implementation of a pthread pool.
+ *
+ * Every worker owns a deque of tasks. A worker pushes and pops the tasks it
+ * spawns at the bottom of its own deque, and steals from the top of the
+ * others' when its own is empty, so threads only meet on the same lock when
+ * one of them runs out of work. Threads waiting for tasks to complete run
+ * queued tasks meanwhile instead of blocking.
  */
 #ifndef PTHREAD_POOL_H_
 #define PTHREAD_POOL_H_
 
 /**
  * Create a new thread pool.
- * 
- * New tasks should be enqueued with pool_enqueue. 
- * Thread_func will be called once per queued task with its sole argument 
+ *
+ * New tasks should be enqueued with pool_enqueue.
+ * Thread_func will be called once per queued task with its sole argument
  * being the argument given to pool_enqueue.
  *
- * \param thread_func The function executed by each thread for each work item.
- * \param threads The number of threads in the pool.
+ * \param thread_func The function executed by each thread for each work item, NULL if only pool_spawn is used.
+ * \param threads The number of threads in the pool, 0 counts as 1. When fewer can be created, the pool runs on those,
+ *                and without any the tasks run in pool_group_wait.
  * \return A pointer to the thread pool.
  */
 void *pool_start(void *(*thread_func)(void *), unsigned int threads);
 
+/**
+ * pool_start with every worker pinned to the CPUs of one NUMA node, read from
+ * /sys/devices/system/node, worker i on node i%pool_nodes. Only the CPUs in the
+ * affinity mask of the process count, and nodes with none of them are left
+ * out. Without that information the workers are not pinned and there is one
+ * node.
+ */
+void *pool_start_numa(void *(*thread_func)(void *), unsigned int threads);
+
+/**
+ * The number of nodes the workers of pool are spread over, 1 when unpinned.
+ */
+int pool_nodes(void *pool);
+
 /**
  * Enqueue a new task for the thread pool.
  *
@@ -26,6 +47,38 @@ void *pool_start(void *(*thread_func)(void *), unsigned int threads);
  */
 void pool_enqueue(void *pool, void *arg, bool free);
 
+/**
+ * Create a wait group: a count of the tasks spawned into it that have not
+ * completed yet, to wait for some tasks of a pool instead of all of them.
+ */
+void *pool_group_create();
+
+/**
+ * Free a wait group with no tasks left.
+ */
+void pool_group_destroy(void *group);
+
+/**
+ * Enqueue fn(arg) for the thread pool, instead of the function of pool_start.
+ * Nothing is allocated per task.
+ *
+ * \param group A wait group returned by pool_group_create, or NULL.
+ */
+void pool_spawn(void *pool, void *(*fn)(void *), void *arg, void *group);
+
+/**
+ * pool_spawn on a worker of node, out of pool_nodes. With more than one node,
+ * only the workers of node run it, never a thread outside the pool, so memory
+ * it touches first is on node. The tasks it spawns may run anywhere.
+ */
+void pool_spawn_on(void *pool, int node, void *(*fn)(void *), void *arg, void *group);
+
+/**
+ * Wait for all tasks spawned into group, including those spawned while
+ * waiting, running queued tasks of the pool in the meantime.
+ */
+void pool_group_wait(void *pool, void *group);
+
 /**
  * Wait for all queued tasks to be completed.
  */